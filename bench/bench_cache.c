@@ -0,0 +1,112 @@
+// cc -O2 -pthread -o bench_cache bench/bench_cache.c  (run from the repository root)
+#define LKJSXCCOM_NO_MAIN
+#include "../lkjsxccom.c"
+
+#define BENCH_ITERATIONS 2000000
+#define BENCH_BUILD_ROUNDS 20
+
+static const char* bench_headers =
+    "Host: lkjsxc.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,ja;q=0.8\r\n"
+    "\r\n";
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void bench_build() {
+    struct response_cache* cache = cache_build(NULL);
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_BUILD_ROUNDS; ++i) {
+        struct response_cache* next = cache_build(cache);
+        cache_free(cache);
+        cache = next;
+    }
+    double reuse_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < BENCH_BUILD_ROUNDS; ++i) {
+        cache_free(cache);
+        cache = cache_build(NULL);
+    }
+    double full_time = now_seconds() - start;
+
+    printf("build    %zu routes  full %8.2f ms  reusing entries %8.2f ms\n", cache->entry_count,
+           full_time / BENCH_BUILD_ROUNDS * 1e3, reuse_time / BENCH_BUILD_ROUNDS * 1e3);
+    cache_free(cache);
+}
+
+static void bench_lookup(const struct response_cache* cache, const char* uri) {
+    size_t uri_len = strlen(uri);
+    size_t sink = 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        sink += cache_lookup(cache, uri, normalize_route_length(uri, uri_len)) != NULL;
+    }
+    double lookup_time = now_seconds() - start;
+
+    printf("lookup   %-24s %7.1f ns  [%s]\n", uri, lookup_time / BENCH_ITERATIONS * 1e9, sink > 0 ? "hit" : "miss");
+}
+
+static void bench_request(const char* uri) {
+    static struct connection_buffer buffer;
+    struct connection conn;
+    int len = snprintf(buffer.request_buffer, REQUEST_BUFFER_SIZE, "GET %s HTTP/1.1\r\n%s", uri, bench_headers);
+    size_t sink = 0;
+
+    memset(&conn, 0, sizeof(conn));
+    conn.buffer = &buffer;
+    conn.file_fd = -1;
+
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        http_request_reset(&buffer.request);
+        conn.request_len = len;
+        if (prepare_next_response(&conn) != RESULT_OK || conn.cached_response == NULL) {
+            fprintf(stderr, "%s did not produce a cached response\n", uri);
+            exit(EXIT_FAILURE);
+        }
+        sink += conn.cached_response->length;
+        cache_unpin(conn.cache);
+        conn.cache = NULL;
+        conn.cached_response = NULL;
+    }
+    double request_time = now_seconds() - start;
+
+    printf("request  %-24s %7.1f ns  parse + route + variant (%d %zu bytes)\n", uri,
+           request_time / BENCH_ITERATIONS * 1e9, conn.status_code, sink / BENCH_ITERATIONS);
+}
+
+int main(int argc, char** argv) {
+    config.worker_count = 1;
+    config.log_level = LOG_LEVEL_ERROR;
+    current_worker = &workers[0];
+    simd_init();
+
+    bench_build();
+
+    struct response_cache* cache = cache_build(NULL);
+    if (cache == NULL) {
+        return EXIT_FAILURE;
+    }
+    cache_publish(cache);
+
+    const char* default_uris[] = {"/", "/test", "/app/teto", "/app/teto/", "/nope"};
+    int uri_count = argc > 1 ? argc - 1 : (int)(sizeof(default_uris) / sizeof(default_uris[0]));
+    const char** uris = argc > 1 ? (const char**)argv + 1 : default_uris;
+
+    for (int i = 0; i < uri_count; ++i) {
+        bench_lookup(cache, uris[i]);
+    }
+    for (int i = 0; i < uri_count; ++i) {
+        bench_request(uris[i]);
+    }
+    return EXIT_SUCCESS;
+}
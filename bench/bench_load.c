@@ -0,0 +1,482 @@
+// cc -O2 -pthread -o bench_load bench/bench_load.c
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_THREADS 2
+#define DEFAULT_DURATION 10
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define MAX_PIPELINE 64
+#define MAX_PATHS 64
+#define REQUEST_MAX_LEN 512
+#define RESPONSE_BUFFER_SIZE (64 * 1024)
+#define LATENCY_BUCKETS 100000
+#define MAX_EVENTS 64
+
+enum result {
+    RESULT_OK,
+    RESULT_ERR,
+    RESULT_ERR_AGAIN
+};
+
+struct config {
+    int connections;
+    int threads;
+    int duration;
+    int pipeline;
+    int keep_alive;
+    const char* accept_encoding;
+    const char* host;
+    int port;
+    const char* paths[MAX_PATHS];
+    int path_count;
+};
+
+struct config config = {
+    .connections = DEFAULT_CONNECTIONS,
+    .threads = DEFAULT_THREADS,
+    .duration = DEFAULT_DURATION,
+    .pipeline = 1,
+    .keep_alive = 1,
+    .accept_encoding = NULL,
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+};
+
+struct stats {
+    long requests;
+    long bytes;
+    long status[6];
+    long errors;
+    long reconnects;
+    uint64_t latency_max;
+    long latency[LATENCY_BUCKETS + 1];
+};
+
+struct load_connection {
+    int fd;
+    int path_index;
+    int in_flight;
+    int head;
+    uint64_t sent_at[MAX_PIPELINE];
+    size_t len;
+    int header_done;
+    long body_remaining;
+    long response_bytes;
+    int status;
+    int close_after;
+    char buffer[RESPONSE_BUFFER_SIZE];
+};
+
+struct load_thread {
+    pthread_t thread;
+    int connection_count;
+    int first_path;
+    struct stats stats;
+};
+
+struct sockaddr_in server_address;
+uint64_t deadline;
+
+uint64_t monotonic_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void record_latency(struct stats* stats, uint64_t nanoseconds) {
+    uint64_t microseconds = nanoseconds / 1000;
+    stats->latency[microseconds < LATENCY_BUCKETS ? microseconds : LATENCY_BUCKETS]++;
+    if (microseconds > stats->latency_max) {
+        stats->latency_max = microseconds;
+    }
+}
+
+int format_request(char* buffer, const char* path) {
+    return snprintf(buffer, REQUEST_MAX_LEN,
+                    "GET %s HTTP/1.1\r\n"
+                    "Host: %s\r\n"
+                    "%s%s%s"
+                    "%s\r\n",
+                    path, config.host,
+                    config.accept_encoding != NULL ? "Accept-Encoding: " : "",
+                    config.accept_encoding != NULL ? config.accept_encoding : "",
+                    config.accept_encoding != NULL ? "\r\n" : "",
+                    config.keep_alive ? "" : "Connection: close\r\n");
+}
+
+enum result send_requests(struct load_connection* conn, int count) {
+    char batch[MAX_PIPELINE * REQUEST_MAX_LEN];
+    size_t len = 0;
+    uint64_t now = monotonic_nanoseconds();
+
+    for (int i = 0; i < count; ++i) {
+        len += format_request(batch + len, config.paths[conn->path_index]);
+        conn->path_index = (conn->path_index + 1) % config.path_count;
+        conn->sent_at[(conn->head + conn->in_flight + i) % MAX_PIPELINE] = now;
+    }
+    conn->in_flight += count;
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t bytes_written = send(conn->fd, batch + written, len - written, MSG_NOSIGNAL);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            return RESULT_ERR;
+        }
+        written += bytes_written;
+    }
+    return RESULT_OK;
+}
+
+enum result open_connection(struct load_connection* conn, int epoll_fd) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        return RESULT_ERR;
+    }
+    int flag = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(conn->fd, (struct sockaddr*)&server_address, sizeof(server_address)) != 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return RESULT_ERR;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return RESULT_ERR;
+    }
+    conn->len = 0;
+    conn->header_done = 0;
+
+    int pending = conn->in_flight;
+    conn->in_flight = 0;
+    conn->head = 0;
+    return send_requests(conn, pending > 0 ? pending : config.pipeline);
+}
+
+void reopen_connection(struct load_connection* conn, int epoll_fd, struct stats* stats) {
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    while (monotonic_nanoseconds() < deadline) {
+        if (open_connection(conn, epoll_fd) == RESULT_OK) {
+            return;
+        }
+        stats->errors++;
+        if (conn->fd != -1) {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+        usleep(1000);
+    }
+}
+
+long header_value(const char* header, const char* end, const char* name) {
+    size_t name_len = strlen(name);
+    for (const char* line = header; line < end;) {
+        const char* next = memchr(line, '\n', end - line);
+        next = next != NULL ? next + 1 : end;
+        if ((size_t)(next - line) > name_len && strncasecmp(line, name, name_len) == 0) {
+            return (long)(line + name_len - header);
+        }
+        line = next;
+    }
+    return -1;
+}
+
+enum result parse_header(struct load_connection* conn) {
+    char* end = memmem(conn->buffer, conn->len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return conn->len == sizeof(conn->buffer) ? RESULT_ERR : RESULT_ERR_AGAIN;
+    }
+    size_t header_len = end + 4 - conn->buffer;
+    if (header_len < 12 || memcmp(conn->buffer, "HTTP/1.", 7) != 0) {
+        return RESULT_ERR;
+    }
+
+    conn->status = atoi(conn->buffer + 9);
+    long offset = header_value(conn->buffer, end, "Content-Length:");
+    conn->body_remaining = offset >= 0 ? strtol(conn->buffer + offset, NULL, 10) : 0;
+    offset = header_value(conn->buffer, end, "Connection:");
+    conn->close_after = offset >= 0 && strncasecmp(conn->buffer + offset + strspn(conn->buffer + offset, " "), "close", 5) == 0;
+    conn->response_bytes = header_len + conn->body_remaining;
+    conn->header_done = 1;
+
+    conn->len -= header_len;
+    memmove(conn->buffer, conn->buffer + header_len, conn->len);
+    return RESULT_OK;
+}
+
+void complete_response(struct load_connection* conn, int epoll_fd, struct stats* stats) {
+    record_latency(stats, monotonic_nanoseconds() - conn->sent_at[conn->head]);
+    conn->head = (conn->head + 1) % MAX_PIPELINE;
+    conn->in_flight--;
+    conn->header_done = 0;
+    stats->requests++;
+    stats->bytes += conn->response_bytes;
+    stats->status[conn->status / 100 < 6 ? conn->status / 100 : 0]++;
+
+    if (conn->close_after || !config.keep_alive) {
+        stats->reconnects += config.keep_alive;
+        reopen_connection(conn, epoll_fd, stats);
+    } else if (conn->in_flight == 0 && send_requests(conn, config.pipeline) != RESULT_OK) {
+        stats->errors++;
+        reopen_connection(conn, epoll_fd, stats);
+    }
+}
+
+void handle_readable(struct load_connection* conn, int epoll_fd, struct stats* stats) {
+    ssize_t bytes_read = read(conn->fd, conn->buffer + conn->len, sizeof(conn->buffer) - conn->len);
+    if (bytes_read <= 0) {
+        if (bytes_read < 0 && errno == EINTR) {
+            return;
+        }
+        stats->reconnects++;
+        reopen_connection(conn, epoll_fd, stats);
+        return;
+    }
+    conn->len += bytes_read;
+
+    while (conn->fd != -1) {
+        if (!conn->header_done) {
+            enum result res = parse_header(conn);
+            if (res == RESULT_ERR_AGAIN) {
+                return;
+            }
+            if (res != RESULT_OK) {
+                stats->errors++;
+                reopen_connection(conn, epoll_fd, stats);
+                return;
+            }
+        }
+
+        size_t body = (size_t)conn->body_remaining < conn->len ? (size_t)conn->body_remaining : conn->len;
+        conn->body_remaining -= body;
+        conn->len -= body;
+        memmove(conn->buffer, conn->buffer + body, conn->len);
+        if (conn->body_remaining > 0) {
+            return;
+        }
+
+        complete_response(conn, epoll_fd, stats);
+    }
+}
+
+void* load_thread_main(void* arg) {
+    struct load_thread* thread = arg;
+    struct load_connection* conns = calloc(thread->connection_count, sizeof(*conns));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conns == NULL || epoll_fd < 0) {
+        perror("bench_load");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < thread->connection_count; ++i) {
+        conns[i].fd = -1;
+        conns[i].path_index = (thread->first_path + i) % config.path_count;
+        reopen_connection(&conns[i], epoll_fd, &thread->stats);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (monotonic_nanoseconds() < deadline) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < count; ++i) {
+            handle_readable(events[i].data.ptr, epoll_fd, &thread->stats);
+        }
+    }
+
+    for (int i = 0; i < thread->connection_count; ++i) {
+        if (conns[i].fd != -1) {
+            close(conns[i].fd);
+        }
+    }
+    close(epoll_fd);
+    free(conns);
+    return NULL;
+}
+
+uint64_t latency_percentile(const struct stats* stats, double percentile) {
+    long target = (long)(stats->requests * percentile);
+    long seen = 0;
+    for (int i = 0; i <= LATENCY_BUCKETS; ++i) {
+        seen += stats->latency[i];
+        if (seen > target) {
+            return i;
+        }
+    }
+    return stats->latency_max;
+}
+
+void print_usage(const char* program) {
+    printf("Usage: %s [options] [path...]\n", program);
+    printf("  -c, --connections N     open connections across all threads (default: %d)\n", DEFAULT_CONNECTIONS);
+    printf("  -t, --threads N         load generator threads (default: %d)\n", DEFAULT_THREADS);
+    printf("  -d, --duration S        run for S seconds (default: %d)\n", DEFAULT_DURATION);
+    printf("  -p, --pipeline N        requests in flight per connection, 1 to %d (default: 1)\n", MAX_PIPELINE);
+    printf("  -n, --no-keepalive      open a new connection for every request\n");
+    printf("  -e, --encoding LIST     send Accept-Encoding: LIST\n");
+    printf("  -s, --server HOST       server IPv4 address (default: %s)\n", DEFAULT_HOST);
+    printf("  -P, --port N            server port (default: %d)\n", DEFAULT_PORT);
+    printf("  -h, --help              show this help\n");
+    printf("Paths are requested round-robin (default: /test).\n");
+}
+
+enum result parse_arguments(int argc, char** argv) {
+    static const struct option options[] = {
+        {"connections", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"pipeline", required_argument, NULL, 'p'},
+        {"no-keepalive", no_argument, NULL, 'n'},
+        {"encoding", required_argument, NULL, 'e'},
+        {"server", required_argument, NULL, 's'},
+        {"port", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "c:t:d:p:ne:s:P:h", options, NULL)) != -1) {
+        switch (option) {
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'd':
+                config.duration = atoi(optarg);
+                break;
+            case 'p':
+                config.pipeline = atoi(optarg);
+                break;
+            case 'n':
+                config.keep_alive = 0;
+                break;
+            case 'e':
+                config.accept_encoding = optarg;
+                break;
+            case 's':
+                config.host = optarg;
+                break;
+            case 'P':
+                config.port = atoi(optarg);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_usage(argv[0]);
+                return RESULT_ERR;
+        }
+    }
+
+    for (; optind < argc && config.path_count < MAX_PATHS; ++optind) {
+        config.paths[config.path_count++] = argv[optind];
+    }
+    if (config.path_count == 0) {
+        config.paths[config.path_count++] = "/test";
+    }
+    if (!config.keep_alive) {
+        config.pipeline = 1;
+    }
+
+    if (config.connections < 1 || config.threads < 1 || config.duration < 1 ||
+        config.pipeline < 1 || config.pipeline > MAX_PIPELINE || config.port < 1 || config.port > 65535) {
+        fprintf(stderr, "Invalid option value\n");
+        return RESULT_ERR;
+    }
+    if (config.threads > config.connections) {
+        config.threads = config.connections;
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host, &server_address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address: %s\n", config.host);
+        return RESULT_ERR;
+    }
+    return RESULT_OK;
+}
+
+int main(int argc, char** argv) {
+    if (parse_arguments(argc, argv) != RESULT_OK) {
+        return EXIT_FAILURE;
+    }
+
+    struct load_thread* threads = calloc(config.threads, sizeof(*threads));
+    struct stats* total = calloc(1, sizeof(*total));
+    if (threads == NULL || total == NULL) {
+        perror("bench_load");
+        return EXIT_FAILURE;
+    }
+
+    printf("%d connections, %d threads, pipeline %d, %s, %ds against %s:%d\n",
+           config.connections, config.threads, config.pipeline, config.keep_alive ? "keep-alive" : "no keep-alive",
+           config.duration, config.host, config.port);
+
+    uint64_t start = monotonic_nanoseconds();
+    deadline = start + (uint64_t)config.duration * 1000000000;
+    for (int i = 0; i < config.threads; ++i) {
+        threads[i].connection_count = config.connections / config.threads + (i < config.connections % config.threads);
+        threads[i].first_path = i;
+        if (pthread_create(&threads[i].thread, NULL, load_thread_main, &threads[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < config.threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        const struct stats* stats = &threads[i].stats;
+        total->requests += stats->requests;
+        total->bytes += stats->bytes;
+        total->errors += stats->errors;
+        total->reconnects += stats->reconnects;
+        for (int status = 0; status < 6; ++status) {
+            total->status[status] += stats->status[status];
+        }
+        for (int bucket = 0; bucket <= LATENCY_BUCKETS; ++bucket) {
+            total->latency[bucket] += stats->latency[bucket];
+        }
+        if (stats->latency_max > total->latency_max) {
+            total->latency_max = stats->latency_max;
+        }
+    }
+    double elapsed = (monotonic_nanoseconds() - start) / 1e9;
+
+    printf("requests   %ld in %.2fs, %.0f req/s, %.2f MB/s\n",
+           total->requests, elapsed, total->requests / elapsed, total->bytes / elapsed / 1e6);
+    printf("latency    p50 %" PRIu64 " us  p99 %" PRIu64 " us  p999 %" PRIu64 " us  max %" PRIu64 " us\n",
+           latency_percentile(total, 0.50), latency_percentile(total, 0.99),
+           latency_percentile(total, 0.999), total->latency_max);
+    printf("status     2xx %ld  3xx %ld  4xx %ld  5xx %ld  errors %ld  reconnects %ld\n",
+           total->status[2], total->status[3], total->status[4], total->status[5], total->errors, total->reconnects);
+
+    int status = total->errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    free(threads);
+    free(total);
+    return status;
+}
@@ -0,0 +1,168 @@
+// cc -O2 -pthread -o bench_parser bench/bench_parser.c
+#define LKJSXCCOM_NO_MAIN
+#include "../lkjsxccom.c"
+
+#define BENCH_ITERATIONS 2000000
+
+static const char bench_request[] =
+    "GET /app/teto/assets/scripts/game.bundle.min.js?v=20250409&lang=en HTTP/1.1\r\n"
+    "Host: lkjsxc.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,ja;q=0.8\r\n"
+    "Cookie: theme=dark; session=8f14e45fceea167a5a36dedd4bea2543c4ca4238a0b923820dcc509a6f75849b\r\n"
+    "\r\n";
+
+struct scan_set {
+    const char* name;
+    size_t (*scan_target)(const char* data, size_t len);
+    size_t (*scan_field)(const char* data, size_t len);
+    int (*contains_dotdot)(const char* data, size_t len);
+};
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void use_scan_set(const struct scan_set* set) {
+    scan_target = set->scan_target;
+    scan_field = set->scan_field;
+    contains_dotdot = set->contains_dotdot;
+}
+
+static int verify_scan_set(const struct scan_set* set) {
+    char data[256];
+    unsigned int seed = 1;
+
+    for (int round = 0; round < 200000; ++round) {
+        size_t len = rand_r(&seed) % sizeof(data);
+        for (size_t i = 0; i < len; ++i) {
+            int r = rand_r(&seed) % 64;
+            data[i] = r == 0 ? (char)(rand_r(&seed) % 256) : r == 1 ? '.' : (char)('a' + r % 26);
+        }
+        if (set->scan_target(data, len) != scan_target_scalar(data, len) ||
+            set->scan_field(data, len) != scan_field_scalar(data, len) ||
+            set->contains_dotdot(data, len) != contains_dotdot_scalar(data, len)) {
+            fprintf(stderr, "%s disagrees with scalar scan (round %d, len %zu)\n", set->name, round, len);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int verify_pipelined_body() {
+    static const char pipelined[] =
+        "GET / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+        "GET /next HTTP/1.1\r\n\r\n";
+    static struct connection_buffer buffer;
+    size_t len = sizeof(pipelined) - 1;
+    size_t body_end = strstr(pipelined, "hello") - pipelined + 5;
+
+    memcpy(buffer.request_buffer, pipelined, len);
+    for (size_t split = 1; split <= len; ++split) {
+        http_request_reset(&buffer.request);
+        enum result res = parse_http_request(&buffer.request, buffer.request_buffer, split);
+        if (res != (split < body_end ? RESULT_ERR_AGAIN : RESULT_OK)) {
+            fprintf(stderr, "pipelined body misparsed at split %zu\n", split);
+            return 0;
+        }
+        if (res == RESULT_ERR_AGAIN && parse_http_request(&buffer.request, buffer.request_buffer, len) != RESULT_OK) {
+            fprintf(stderr, "pipelined body did not resume at split %zu\n", split);
+            return 0;
+        }
+        if (buffer.request.offset != body_end || buffer.request.content_length != 5) {
+            fprintf(stderr, "pipelined body framed at %u, expected %zu\n", buffer.request.offset, body_end);
+            return 0;
+        }
+    }
+
+    http_request_reset(&buffer.request);
+    if (parse_http_request(&buffer.request, buffer.request_buffer + body_end, len - body_end) != RESULT_OK ||
+        !view_equals(buffer.request_buffer + body_end, buffer.request.path, "/next")) {
+        fprintf(stderr, "request after pipelined body misparsed\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void bench_scan_set(const struct scan_set* set) {
+    static char field[1024];
+    static struct connection_buffer buffer;
+    size_t sink = 0;
+
+    memset(field, 'a', sizeof(field) - 1);
+    field[sizeof(field) - 1] = '\r';
+
+    double start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        sink += set->scan_field(field, sizeof(field) - (i & 7));
+    }
+    double field_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        sink += set->contains_dotdot(field, sizeof(field) - (i & 7));
+    }
+    double dotdot_time = now_seconds() - start;
+
+    use_scan_set(set);
+    memcpy(buffer.request_buffer, bench_request, sizeof(bench_request) - 1);
+    start = now_seconds();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        http_request_reset(&buffer.request);
+        if (parse_http_request(&buffer.request, buffer.request_buffer, sizeof(bench_request) - 1) != RESULT_OK) {
+            fprintf(stderr, "bench request failed to parse\n");
+            exit(EXIT_FAILURE);
+        }
+        sink += buffer.request.header_count;
+    }
+    double parse_time = now_seconds() - start;
+
+    printf("%-8s scan_field %6.2f GB/s  contains_dotdot %6.2f GB/s  parse %7.1f ns/request (%.0f req/s)  [%zu]\n",
+           set->name,
+           BENCH_ITERATIONS * (double)sizeof(field) / field_time / 1e9,
+           BENCH_ITERATIONS * (double)sizeof(field) / dotdot_time / 1e9,
+           parse_time / BENCH_ITERATIONS * 1e9,
+           BENCH_ITERATIONS / parse_time,
+           sink);
+}
+
+int main() {
+    struct scan_set sets[4];
+    int set_count = 0;
+
+    sets[set_count++] = (struct scan_set){"scalar", scan_target_scalar, scan_field_scalar, contains_dotdot_scalar};
+#if defined(SIMD_SSE2)
+    sets[set_count++] = (struct scan_set){"sse2", scan_target_sse2, scan_field_sse2, contains_dotdot_sse2};
+    if (__builtin_cpu_supports("avx2")) {
+        sets[set_count++] = (struct scan_set){"avx2", scan_target_avx2, scan_field_avx2, contains_dotdot_avx2};
+    }
+#elif defined(SIMD_NEON)
+    sets[set_count++] = (struct scan_set){"neon", scan_target_neon, scan_field_neon, contains_dotdot_neon};
+#endif
+
+    if (!verify_pipelined_body()) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < set_count; ++i) {
+        if (!verify_scan_set(&sets[i])) {
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < set_count; ++i) {
+        bench_scan_set(&sets[i]);
+    }
+    return EXIT_SUCCESS;
+}
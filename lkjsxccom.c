@@ -1,26 +1,137 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #define PORT 8080
-#define MAX_CONNECTIONS 24
+#define DEFAULT_MAX_CONNECTIONS 16384
+#define CONNECTION_SLAB_SIZE 256
+#define DEFAULT_LISTEN_BACKLOG 4096
+#define ACCEPT_BATCH_SIZE 64
 #define REQUEST_BUFFER_SIZE 2048
 
 #define RESPONSE_BUFFER_SIZE 2048
 #define ERRORRESPONSE_BUFFER_SIZE 2048
-#define FILE_BUFFER_SIZE 4096
-#define METHOD_MAX_LEN 16
-#define URI_MAX_LEN 256
-#define VERSION_MAX_LEN 16
+#define MAX_HEADERS 32
+#define DISCARD_INPUT_MAX (64 * 1024)
+#define ETAG_MAX_LEN 48
+#define HTTP_DATE_MAX_LEN 32
 #define FILE_PATH_MAX_LEN 512
 #define BASE_ROUTE_PATH "./routes"
+#define MAX_EVENTS 64
+#define MAX_WORKERS 64
+#define DEFAULT_WORKER_COUNT 0
+#define CACHE_LINE_SIZE 64
+#define ROUTE_BUCKET_LOAD 4
+#define ROUTE_MAX_SLOTS (1 << 24)
+#define CACHE_MAX_FILE_SIZE (1024 * 1024)
+#define CACHE_REFRESH_INTERVAL 2
+#define CACHE_SETTLE_MS 50
+#define CACHE_RECLAIM_INTERVAL_MS 1000
+#define CACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+#define ROUTE_PAGE_NAME "page.html"
+#define ERROR_PAGE_SUFFIX ".html"
+#define ERROR_RESPONSE_COUNT 8
+#define BUNDLE_MAGIC "LKJSXB05"
+#define CACHE_POLICY_MAX_RULES 64
+#define CACHE_POLICY_MAX_LEN 128
+#define DEFAULT_KEEPALIVE_TIMEOUT 5
+#define DEFAULT_MAX_REQUESTS 100
+#define DEFAULT_REQUEST_TIMEOUT 10
+#define DEFAULT_SEND_TIMEOUT 30
+#define DEFAULT_DRAIN_TIMEOUT 30
+#define HANDOFF_RECEIVE_TIMEOUT 5
+#define RETRY_AFTER_SECONDS 1
+#define ACCEPT_RESUME_DIVISOR 16
+#define ADMISSION_TABLE_SIZE 4096
+#define ADMISSION_PROBE_LIMIT 16
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 3
+#define ACCESS_LOG_RING_SIZE 1024
+#define ACCESS_LOG_URI_MAX_LEN 96
+#define ACCESS_LOG_BATCH_SIZE (64 * 1024)
+#define ACCESS_LOG_FLUSH_INTERVAL_MS 100
+#define LOG_LINE_MAX_LEN 1024
+#define METRICS_STATUS_COUNT 13
+#define METRICS_REQUEST_MAX_LEN 1024
+#define HISTOGRAM_SUB_BITS 2
+#define HISTOGRAM_BUCKET_COUNT 104
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_CHUNK_SIZE 16384
+#define URING_QUEUE_DEPTH 1024
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 2048
+#define URING_BUFFER_GROUP 0
+#define URING_MAX_HELD_BUFFERS 4
+#define URING_NO_BUFFER 0xffff
+#define URING_OP_MASK 7
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_INFO
+#endif
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#else
+#error "no event backend for this platform"
+#endif
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef WITH_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define SIMD_SSE2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON 1
+#endif
 
 enum result {
     RESULT_OK,
@@ -28,609 +139,5312 @@ enum result {
     RESULT_ERR_AGAIN
 };
 
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
 enum method {
     METHOD_GET,
     METHOD_UNKNOWN
 };
 
+enum event_interest {
+    EVENT_READ = 1,
+    EVENT_WRITE = 2
+};
+
+enum connection_state {
+    CONNECTION_READING,
+    CONNECTION_WRITING
+};
+
 enum status_code {
     STATUS_OK = 200,
+    STATUS_PARTIAL_CONTENT = 206,
+    STATUS_NOT_MODIFIED = 304,
     STATUS_BAD_REQUEST = 400,
     STATUS_NOT_FOUND = 404,
     STATUS_INTERNAL_SERVER_ERROR = 500,
-    STATUS_METHOD_NOT_ALLOWED = 405
+    STATUS_METHOD_NOT_ALLOWED = 405,
+    STATUS_CONTENT_TOO_LARGE = 413,
+    STATUS_URI_TOO_LONG = 414,
+    STATUS_RANGE_NOT_SATISFIABLE = 416,
+    STATUS_HEADER_FIELDS_TOO_LARGE = 431,
+    STATUS_SERVICE_UNAVAILABLE = 503
+};
+
+enum overload_policy {
+    OVERLOAD_PAUSE,
+    OVERLOAD_REJECT,
+    OVERLOAD_CLOSE
+};
+
+enum range_result {
+    RANGE_NONE,
+    RANGE_SATISFIABLE,
+    RANGE_NOT_SATISFIABLE
+};
+
+enum content_encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BROTLI,
+    ENCODING_COUNT
+};
+
+#ifdef WITH_IO_URING
+enum uring_op {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL,
+    URING_OP_CANCEL,
+    URING_OP_WAKE,
+    URING_OP_CANCEL_ACCEPT
+};
+
+enum uring_connection_flag {
+    URING_RECV_ARMED = 1,
+    URING_RECV_CANCELING = 2,
+    URING_STARVED = 4,
+    URING_PEER_CLOSED = 8,
+    URING_CLOSING = 16
+};
+#endif
+
+enum parse_state {
+    PARSE_METHOD,
+    PARSE_TARGET,
+    PARSE_VERSION,
+    PARSE_LINE_END,
+    PARSE_HEADER_NAME,
+    PARSE_HEADER_VALUE,
+    PARSE_HEADERS_END,
+    PARSE_BODY,
+    PARSE_DONE,
+    PARSE_TOO_MANY_HEADERS
+};
+
+struct event {
+    void* data;
+    int events;
+};
+
+struct string_view {
+    uint16_t offset;
+    uint16_t length;
+};
+
+struct http_header {
+    struct string_view name;
+    struct string_view value;
+};
+
+struct http_request {
+    enum parse_state state;
+    uint16_t offset;
+    uint16_t token_start;
+    struct string_view method;
+    struct string_view path;
+    struct string_view query;
+    struct string_view version;
+    int version_minor;
+    struct http_header headers[MAX_HEADERS];
+    int header_count;
+    ssize_t content_length;
+};
+
+#define VIEW_ARGS(buffer, view) (int)(view).length, (buffer) + (view).offset
+
+struct cached_response {
+    char* data;
+    size_t length;
+    size_t header_len;
+    char etag[ETAG_MAX_LEN];
+};
+
+struct mime_type {
+    const char* extension;
+    const char* content_type;
+    int compressible;
+};
+
+struct cache_policy_rule {
+    char pattern[CACHE_POLICY_MAX_LEN];
+    char value[CACHE_POLICY_MAX_LEN];
+};
+
+struct admission_slot {
+    _Atomic uint64_t owner; // IPv4 address << 32 | open connections
+    _Atomic uint64_t rate;  // second << 32 | requests in that second
+};
+
+struct cache_entry {
+    int refs;
+    uint64_t hash;
+    uint64_t signature;
+    char* uri;
+    size_t uri_len;
+    char* file_path;
+    const struct mime_type* mime_type;
+    const char* cache_control;
+    time_t last_modified;
+    struct cached_response variants[ENCODING_COUNT];
+    struct cached_response not_modified[ENCODING_COUNT];
+};
+
+struct cache_pin {
+    _Atomic long count;
+    char padding[CACHE_LINE_SIZE - sizeof(long)];
+};
+
+struct response_cache {
+    struct cache_entry** entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    struct cache_entry** route_slots;
+    uint16_t* route_displacements;
+    uint32_t route_slot_mask;
+    uint32_t route_bucket_mask;
+    struct cached_response errors[ERROR_RESPONSE_COUNT];
+    struct cache_entry* bundle_entries;
+    void* bundle;
+    size_t bundle_len;
+    uint64_t signature;
+    uint64_t retire_epoch;
+    struct response_cache* retired_next;
+    struct cache_pin pins[MAX_WORKERS];
+};
+
+struct connection_buffer {
+    struct connection_buffer* next;
+    struct http_request request;
+    char request_buffer[REQUEST_BUFFER_SIZE];
+    char response_header_buffer[RESPONSE_BUFFER_SIZE];
+#ifdef WITH_IO_URING
+    struct msghdr message;
+    struct iovec message_iov[3];
+#endif
 };
 
 struct connection {
     struct connection* next;
     int client_fd;
+    enum connection_state state;
 
-    char request_buffer[REQUEST_BUFFER_SIZE];
+    struct connection_buffer* buffer;
     size_t request_len;
+    size_t request_end;
+    int keep_alive;
+    int requests_served;
+    int slot;
+    uint64_t accepted_at;
+    uint64_t request_start;
+    struct connection* timer_next;
+    struct connection** timer_prev;
+    uint64_t timer_expires;
 
     enum method method;
-    char uri[URI_MAX_LEN];
 
-    char response_header_buffer[RESPONSE_BUFFER_SIZE];
-    char file_buffer[FILE_BUFFER_SIZE];
-    char file_path[FILE_PATH_MAX_LEN];
     int status_code;
-    FILE* file_to_send;
-    long file_size;
+    int file_fd;
+    off_t file_offset;
+    off_t file_end;
+    size_t range_offset;
+    size_t range_len;
     long bytes_sent;
-    int headers_sent;
+    int response_header_len;
+
+    struct response_cache* cache;
+    const struct cached_response* cached_response;
+    struct admission_slot* admission;
+
+#ifdef WITH_TLS
+    SSL* tls;
+    int tls_kernel_send;
+#endif
+#ifdef WITH_IO_URING
+    struct connection* uring_starved_next;
+    int uring_pending;
+    uint16_t uring_flags;
+    uint16_t uring_held_head;
+    uint16_t uring_held_tail;
+    uint16_t uring_held_offset;
+    uint16_t uring_held_count;
+#endif
 };
 
-struct connection connection_pool[MAX_CONNECTIONS];
-struct connection* connection_active = NULL;
-struct connection* connection_free = NULL;
+struct access_log_record {
+    time_t time;
+    long bytes;
+    uint32_t latency_us;
+    uint16_t status;
+    uint8_t method_len;
+    uint8_t uri_len;
+    char method[8];
+    char uri[ACCESS_LOG_URI_MAX_LEN];
+};
 
-void initialize_connection_pool() {
-    connection_free = NULL;
-    connection_active = NULL;
-    for (int i = MAX_CONNECTIONS - 1; i >= 0; --i) {
-        connection_pool[i].client_fd = -1;
-        connection_pool[i].next = connection_free;
-        connection_free = &connection_pool[i];
-    }
-    printf("Connection pool initialized with %d connections.\n", MAX_CONNECTIONS);
-}
+struct access_log_ring {
+    _Atomic size_t head;
+    char head_padding[CACHE_LINE_SIZE - sizeof(size_t)];
+    _Atomic size_t tail;
+    _Atomic unsigned long dropped;
+    char tail_padding[CACHE_LINE_SIZE - sizeof(size_t) - sizeof(unsigned long)];
+    struct access_log_record records[ACCESS_LOG_RING_SIZE];
+};
 
-struct connection* get_free_connection() {
-    if (connection_free == NULL) {
-        return NULL;
-    }
-    struct connection* conn = connection_free;
-    connection_free = conn->next;
+struct connection_slot {
+    struct connection* conn;
+};
 
-    conn->next = connection_active;
-    connection_active = conn;
+struct latency_histogram {
+    _Atomic unsigned long buckets[HISTOGRAM_BUCKET_COUNT];
+    _Atomic unsigned long sum_us;
+};
 
-    conn->request_len = 0;
-    conn->file_to_send = NULL;
-    conn->file_size = 0;
-    conn->bytes_sent = 0;
-    conn->headers_sent = 0;
-    conn->status_code = STATUS_OK;
+struct worker_metrics {
+    _Atomic unsigned long accepts;
+    _Atomic unsigned long rejects;
+    _Atomic unsigned long accept_pauses;
+    _Atomic unsigned long responses[METRICS_STATUS_COUNT];
+    _Atomic unsigned long bytes_sent;
+    _Atomic unsigned long cache_hits;
+    _Atomic unsigned long cache_misses;
+    _Atomic unsigned long send_again;
+    _Atomic unsigned long traversal_rejects;
+    struct latency_histogram first_byte_latency;
+    struct latency_histogram response_latency;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
-    memset(conn->request_buffer, 0, REQUEST_BUFFER_SIZE);
-    memset(conn->response_header_buffer, 0, RESPONSE_BUFFER_SIZE);
-    memset(conn->file_buffer, 0, FILE_BUFFER_SIZE);
-    memset(conn->uri, 0, URI_MAX_LEN);
-    memset(conn->file_path, 0, FILE_PATH_MAX_LEN);
+struct handoff_message {
+    int listener_count;
+    int metrics;
+};
 
-    return conn;
-}
+struct worker {
+    _Atomic uint64_t epoch;
+    int id;
+    int cpu;
+    int listen_fd;
+    int accept_paused;
+    int accept_armed;
+    int accept_multishot;
+    pthread_t thread;
+    struct access_log_ring* access_log;
+    struct worker_metrics metrics;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
-void release_connection(struct connection* conn) {
-    if (conn == NULL)
-        return;
+struct config {
+    int worker_count;
+    int keepalive_timeout;
+    int request_timeout;
+    int send_timeout;
+    int max_requests;
+    int max_connections;
+    int backlog;
+    int log_level;
+    const char* access_log_path;
+    int metrics_port;
+    const char* bundle_path;
+    const char* pack_bundle_path;
+    const char* cache_policy_path;
+    int cpu_affinity;
+    const char* handoff_path;
+    int drain_timeout;
+    enum overload_policy overload;
+    int ip_connections;
+    int ip_rate;
+#ifdef WITH_TLS
+    const char* tls_cert_path;
+    const char* tls_key_path;
+#endif
+#ifdef WITH_IO_URING
+    int io_uring;
+#endif
+};
 
-    struct connection** ptr = &connection_active;
-    while (*ptr != NULL) {
-        if (*ptr == conn) {
-            *ptr = conn->next;
-            break;
-        }
-        ptr = &((*ptr)->next);
-    }
+struct config config = {
+    .worker_count = DEFAULT_WORKER_COUNT,
+    .keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT,
+    .request_timeout = DEFAULT_REQUEST_TIMEOUT,
+    .send_timeout = DEFAULT_SEND_TIMEOUT,
+    .max_requests = DEFAULT_MAX_REQUESTS,
+    .max_connections = DEFAULT_MAX_CONNECTIONS,
+    .backlog = DEFAULT_LISTEN_BACKLOG,
+    .log_level = LOG_LEVEL_INFO,
+    .access_log_path = "-",
+    .metrics_port = 0,
+    .bundle_path = NULL,
+    .pack_bundle_path = NULL,
+    .cache_policy_path = NULL,
+    .cpu_affinity = 0,
+    .handoff_path = NULL,
+    .drain_timeout = DEFAULT_DRAIN_TIMEOUT,
+    .overload = OVERLOAD_PAUSE,
+    .ip_connections = 0,
+    .ip_rate = 0,
+};
 
-    conn->next = connection_free;
-    connection_free = conn;
+#define log_at(level, ...)                                                  \
+    do {                                                                    \
+        if ((level) <= LOG_LEVEL_MAX && (int)(level) <= config.log_level) { \
+            log_write((level), __VA_ARGS__);                                \
+        }                                                                   \
+    } while (0)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_errno(message) log_error("%s: %s", (message), strerror(errno))
 
-    if (conn->client_fd != -1) {
-        close(conn->client_fd);
-        conn->client_fd = -1;
+struct worker workers[MAX_WORKERS];
+
+static const char* const encoding_names[ENCODING_COUNT] = {"identity", "gzip", "br"};
+static const char* const encoding_suffixes[ENCODING_COUNT] = {"", ".gz", ".br"};
+
+static const struct mime_type mime_types[] = {
+    {"avif", "image/avif", 0},
+    {"bmp", "image/bmp", 1},
+    {"css", "text/css", 1},
+    {"csv", "text/csv", 1},
+    {"gif", "image/gif", 0},
+    {"htm", "text/html", 1},
+    {"html", "text/html", 1},
+    {"ico", "image/vnd.microsoft.icon", 1},
+    {"jpeg", "image/jpeg", 0},
+    {"jpg", "image/jpeg", 0},
+    {"js", "text/javascript", 1},
+    {"json", "application/json", 1},
+    {"map", "application/json", 1},
+    {"md", "text/markdown", 1},
+    {"mjs", "text/javascript", 1},
+    {"mp3", "audio/mpeg", 0},
+    {"mp4", "video/mp4", 0},
+    {"ogg", "audio/ogg", 0},
+    {"otf", "font/otf", 1},
+    {"pdf", "application/pdf", 0},
+    {"png", "image/png", 0},
+    {"svg", "image/svg+xml", 1},
+    {"ttf", "font/ttf", 1},
+    {"txt", "text/plain", 1},
+    {"wasm", "application/wasm", 1},
+    {"webm", "video/webm", 0},
+    {"webmanifest", "application/manifest+json", 1},
+    {"webp", "image/webp", 0},
+    {"woff", "font/woff", 0},
+    {"woff2", "font/woff2", 0},
+    {"xml", "application/xml", 1},
+    {"zip", "application/zip", 0},
+};
+static const struct mime_type default_mime_type = {"", "application/octet-stream", 0};
+
+_Atomic(struct response_cache*) response_cache_current = NULL;
+_Atomic uint64_t response_cache_epoch = 1;
+struct response_cache* response_cache_retired = NULL;
+int cache_watch_fd = -1;
+int cache_signal_fd = -1;
+struct cache_policy_rule cache_policy_rules[CACHE_POLICY_MAX_RULES];
+int cache_policy_rule_count = 0;
+
+__thread struct connection_slot* connection_slots = NULL;
+__thread int connection_active_count = 0;
+__thread struct connection* connection_free = NULL;
+__thread int connection_allocated = 0;
+__thread int connection_limit = 0;
+__thread struct connection_buffer* connection_buffer_free = NULL;
+__thread int event_fd = -1;
+__thread struct worker* current_worker = NULL;
+__thread uint64_t loop_tick = 0;
+__thread uint64_t timer_tick = 0;
+__thread int timer_count = 0;
+__thread struct connection* timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+
+static const char* const log_level_names[] = {"error", "warn", "info", "debug"};
+int access_log_fd = -1;
+int metrics_fd = -1;
+int request_timing = 0;
+int handoff_fd = -1;
+int handoff_signal_fd = -1;
+int handoff_wake_fd = -1;
+int handoff_listeners[MAX_WORKERS];
+int handoff_listener_count = 0;
+int handoff_metrics_fd = -1;
+struct admission_slot admission_table[ADMISSION_TABLE_SIZE];
+char** handoff_argv = NULL;
+_Atomic int server_draining = 0;
+_Atomic uint64_t drain_deadline = 0;
+#ifdef WITH_TLS
+SSL_CTX* tls_ctx = NULL;
+#endif
+
+__attribute__((format(printf, 2, 3))) void log_write(enum log_level level, const char* format, ...) {
+    char line[LOG_LINE_MAX_LEN];
+    int len = snprintf(line, sizeof(line), "[%s] ", log_level_names[level]);
+
+    va_list args;
+    va_start(args, format);
+    int message_len = vsnprintf(line + len, sizeof(line) - len - 1, format, args);
+    va_end(args);
+
+    if (message_len < 0) {
+        return;
     }
-    if (conn->file_to_send != NULL) {
-        fclose(conn->file_to_send);
-        conn->file_to_send = NULL;
+    len += message_len;
+    if ((size_t)len > sizeof(line) - 2) {
+        len = sizeof(line) - 2;
     }
-    printf("Released connection for fd %d\n", conn->client_fd);
+    line[len++] = '\n';
+    ssize_t ignored = write(STDERR_FILENO, line, len);
+    (void)ignored;
 }
 
-void close_connection(struct connection* conn) {
-    if (conn) {
-        printf("Closing connection for fd %d\n", conn->client_fd);
-        release_connection(conn);
+enum result event_backend_init() {
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd < 0) {
+        log_errno("epoll_create1 failed");
+        return RESULT_ERR;
     }
+    return RESULT_OK;
 }
 
-enum result setup_server_socket(int* listen_fd) {
-    struct sockaddr_in server_addr;
-
-    *listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (*listen_fd < 0) {
-        perror("socket failed");
-        return RESULT_ERR;
+static uint32_t event_backend_mask(int interest, int edge_triggered) {
+    uint32_t mask = 0;
+    if (interest & EVENT_READ) {
+        mask |= EPOLLIN | EPOLLRDHUP;
     }
-
-    int opt = 1;
-    if (setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
-        close(*listen_fd);
-        return RESULT_ERR;
+    if (interest & EVENT_WRITE) {
+        mask |= EPOLLOUT;
     }
-
-    int flags = fcntl(*listen_fd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl(F_GETFL) failed");
-        close(*listen_fd);
-        return RESULT_ERR;
+    if (edge_triggered) {
+        mask |= EPOLLET;
     }
-    if (fcntl(*listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl(F_SETFL O_NONBLOCK) failed");
-        close(*listen_fd);
+    return mask;
+}
+
+enum result event_backend_add(int fd, int interest, void* data, int edge_triggered) {
+    struct epoll_event ev;
+    ev.events = event_backend_mask(interest, edge_triggered);
+    ev.data.ptr = data;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_errno("epoll_ctl(EPOLL_CTL_ADD) failed");
         return RESULT_ERR;
     }
+    return RESULT_OK;
+}
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+void event_backend_remove(int fd) {
+    if (epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        log_errno("epoll_ctl(EPOLL_CTL_DEL) failed");
+    }
+}
 
-    if (bind(*listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind failed");
-        close(*listen_fd);
+enum result event_backend_modify(int fd, int interest, void* data, int edge_triggered) {
+    struct epoll_event ev;
+    ev.events = event_backend_mask(interest, edge_triggered);
+    ev.data.ptr = data;
+    if (epoll_ctl(event_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        log_errno("epoll_ctl(EPOLL_CTL_MOD) failed");
         return RESULT_ERR;
     }
+    return RESULT_OK;
+}
 
-    if (listen(*listen_fd, MAX_CONNECTIONS) < 0) {
-        perror("listen failed");
-        close(*listen_fd);
-        return RESULT_ERR;
+int event_backend_wait(struct event* events, int max_events, int timeout_ms) {
+    struct epoll_event ready[MAX_EVENTS];
+    if (max_events > MAX_EVENTS) {
+        max_events = MAX_EVENTS;
     }
 
-    printf("Server listening on port %d\n", PORT);
-    return RESULT_OK;
+    int count = epoll_wait(event_fd, ready, max_events, timeout_ms);
+    for (int i = 0; i < count; ++i) {
+        events[i].data = ready[i].data.ptr;
+        events[i].events = 0;
+        if (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            events[i].events |= EVENT_READ;
+        }
+        if (ready[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            events[i].events |= EVENT_WRITE;
+        }
+    }
+    return count;
 }
 
-enum result parse_request(struct connection* conn) {
-    char method_str[METHOD_MAX_LEN];
-    char uri_str[URI_MAX_LEN];
-    char version_str[VERSION_MAX_LEN];
+uint64_t hash_bytes(const char* data, size_t len) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-    conn->request_buffer[conn->request_len] = '\0';
+uint64_t hash_mix(uint64_t hash, uint64_t value) {
+    return (hash ^ value) * 1099511628211ULL;
+}
 
-    int items_parsed = sscanf(conn->request_buffer, "%15s %255s %15s", method_str, uri_str, version_str);
+uint64_t hash_finalize(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    if (items_parsed < 2) {
-        fprintf(stderr, "Failed to parse request (items parsed: %d): %s\n", items_parsed, conn->request_buffer);
-        conn->status_code = STATUS_BAD_REQUEST;
-        return RESULT_ERR;
+void cache_entry_release(struct cache_entry* entry) {
+    if (--entry->refs > 0) {
+        return;
+    }
+    for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+        free(entry->variants[encoding].data);
+        free(entry->not_modified[encoding].data);
     }
+    free(entry->uri);
+    free(entry->file_path);
+    free(entry);
+}
 
-    if (strncmp(method_str, "GET", METHOD_MAX_LEN) == 0) {
-        conn->method = METHOD_GET;
+void cache_free(struct response_cache* cache) {
+    if (cache->bundle != NULL) {
+        free(cache->bundle_entries);
+        munmap(cache->bundle, cache->bundle_len);
     } else {
-        conn->method = METHOD_UNKNOWN;
-        conn->status_code = STATUS_METHOD_NOT_ALLOWED;
-
-        strncpy(conn->uri, uri_str, URI_MAX_LEN - 1);
-        conn->uri[URI_MAX_LEN - 1] = '\0';
-        return RESULT_ERR;
+        for (size_t i = 0; i < cache->entry_count; ++i) {
+            cache_entry_release(cache->entries[i]);
+        }
+        for (int i = 0; i < ERROR_RESPONSE_COUNT; ++i) {
+            free(cache->errors[i].data);
+        }
     }
+    free(cache->entries);
+    free(cache->route_slots);
+    free(cache->route_displacements);
+    free(cache);
+}
 
-    strncpy(conn->uri, uri_str, URI_MAX_LEN - 1);
-    conn->uri[URI_MAX_LEN - 1] = '\0';
+char* read_file(const char* file_path, size_t* file_size, struct stat* file_stat) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, file_stat) != 0 || !S_ISREG(file_stat->st_mode)) {
+        close(fd);
+        return NULL;
+    }
 
-    if (strstr(conn->uri, "..") != NULL) {
-        fprintf(stderr, "Directory traversal attempt detected: %s\n", conn->uri);
-        conn->status_code = STATUS_BAD_REQUEST;
-        return RESULT_ERR;
+    *file_size = file_stat->st_size;
+    char* data = malloc(*file_size > 0 ? *file_size : 1);
+    if (data == NULL) {
+        log_error("Out of memory while reading %s", file_path);
+        close(fd);
+        return NULL;
     }
 
-    printf("Parsed Request: Method=GET, URI=%s\n", conn->uri);
-    return RESULT_OK;
+    size_t total_read = 0;
+    while (total_read < *file_size) {
+        ssize_t bytes_read = read(fd, data + total_read, *file_size - total_read);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            log_warn("Short read while caching %s", file_path);
+            free(data);
+            close(fd);
+            return NULL;
+        }
+        total_read += bytes_read;
+    }
+    close(fd);
+    return data;
 }
 
-enum result build_file_path(struct connection* conn) {
-    const char* uri_target = conn->uri;
+char* compress_body(enum content_encoding encoding, const char* body, size_t body_len, size_t* compressed_len) {
+#ifdef WITH_ZLIB
+    if (encoding == ENCODING_GZIP) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        size_t capacity = deflateBound(&stream, body_len);
+        char* data = malloc(capacity);
+        if (data == NULL) {
+            deflateEnd(&stream);
+            return NULL;
+        }
+        stream.next_in = (Bytef*)body;
+        stream.avail_in = body_len;
+        stream.next_out = (Bytef*)data;
+        stream.avail_out = capacity;
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+            deflateEnd(&stream);
+            free(data);
+            return NULL;
+        }
+        *compressed_len = stream.total_out;
+        deflateEnd(&stream);
+        return data;
+    }
+#endif
+#ifdef WITH_BROTLI
+    if (encoding == ENCODING_BROTLI) {
+        size_t capacity = BrotliEncoderMaxCompressedSize(body_len);
+        char* data = capacity > 0 ? malloc(capacity) : NULL;
+        if (data == NULL) {
+            return NULL;
+        }
+        *compressed_len = capacity;
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                                   body_len, (const uint8_t*)body, compressed_len, (uint8_t*)data)) {
+            free(data);
+            return NULL;
+        }
+        return data;
+    }
+#endif
+    (void)encoding;
+    (void)body;
+    (void)body_len;
+    (void)compressed_len;
+    return NULL;
+}
 
-    int len = snprintf(conn->file_path, FILE_PATH_MAX_LEN, "%s%s/page.html", BASE_ROUTE_PATH, uri_target);
+char* load_variant_body(enum content_encoding encoding, const char* file_path, const struct stat* page_stat,
+                        const char* body, size_t body_len, int compressible, size_t* variant_len) {
+    char variant_path[FILE_PATH_MAX_LEN];
+    struct stat variant_stat;
+    snprintf(variant_path, sizeof(variant_path), "%s%s", file_path, encoding_suffixes[encoding]);
 
-    if (len < 0 || len >= FILE_PATH_MAX_LEN) {
-        fprintf(stderr, "Error formatting file path or path too long for URI: %s\n", conn->uri);
-        conn->status_code = STATUS_INTERNAL_SERVER_ERROR;
-        return RESULT_ERR;
+    char* data = read_file(variant_path, variant_len, &variant_stat);
+    if (data != NULL) {
+        if (variant_stat.st_mtime >= page_stat->st_mtime) {
+            return data;
+        }
+        log_warn("Ignoring %s: older than %s", variant_path, file_path);
+        free(data);
     }
+    return compressible ? compress_body(encoding, body, body_len, variant_len) : NULL;
+}
 
-    return RESULT_OK;
+void format_http_date(time_t time, char* buffer, size_t size) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
 }
 
 const char* get_status_message(int status_code) {
     switch (status_code) {
         case STATUS_OK:
             return "OK";
+        case STATUS_PARTIAL_CONTENT:
+            return "Partial Content";
+        case STATUS_NOT_MODIFIED:
+            return "Not Modified";
         case STATUS_BAD_REQUEST:
             return "Bad Request";
         case STATUS_NOT_FOUND:
             return "Not Found";
         case STATUS_METHOD_NOT_ALLOWED:
             return "Method Not Allowed";
+        case STATUS_CONTENT_TOO_LARGE:
+            return "Content Too Large";
+        case STATUS_URI_TOO_LONG:
+            return "URI Too Long";
+        case STATUS_RANGE_NOT_SATISFIABLE:
+            return "Range Not Satisfiable";
+        case STATUS_HEADER_FIELDS_TOO_LARGE:
+            return "Request Header Fields Too Large";
         case STATUS_INTERNAL_SERVER_ERROR:
             return "Internal Server Error";
+        case STATUS_SERVICE_UNAVAILABLE:
+            return "Service Unavailable";
         default:
             return "Unknown Status";
     }
 }
 
-enum result prepare_error_response(struct connection* conn) {
-    conn->headers_sent = 0;
-    conn->file_to_send = NULL;
-
-    int len = snprintf(conn->response_header_buffer, RESPONSE_BUFFER_SIZE,
-                       "HTTP/1.1 %d %s\r\n"
-                       "Content-Type: text/html\r\n"
-                       "Content-Length: %d\r\n"
-                       "Connection: close\r\n\r\n"
-                       "<html><body><h1>%d %s</h1></body></html>",
-                       conn->status_code, get_status_message(conn->status_code),
-                       (int)strlen("<html><body><h1>") + 3 + (int)strlen(get_status_message(conn->status_code)) + (int)strlen("</h1></body></html>"),
-                       conn->status_code, get_status_message(conn->status_code));
+const int error_statuses[ERROR_RESPONSE_COUNT] = {
+    STATUS_BAD_REQUEST,
+    STATUS_NOT_FOUND,
+    STATUS_METHOD_NOT_ALLOWED,
+    STATUS_CONTENT_TOO_LARGE,
+    STATUS_URI_TOO_LONG,
+    STATUS_HEADER_FIELDS_TOO_LARGE,
+    STATUS_INTERNAL_SERVER_ERROR,
+    STATUS_SERVICE_UNAVAILABLE
+};
 
-    if (len < 0 || len >= RESPONSE_BUFFER_SIZE) {
-        fprintf(stderr, "Error formatting error response buffer.\n");
+int error_response_index(int status_code) {
+    for (int i = 0; i < ERROR_RESPONSE_COUNT; ++i) {
+        if (error_statuses[i] == status_code) {
+            return i;
+        }
+    }
+    return -1;
+}
 
+enum result cache_store_response(struct cached_response* response, const char* header, size_t header_len, const char* body, size_t body_len) {
+    response->data = malloc(header_len + body_len);
+    if (response->data == NULL) {
         return RESULT_ERR;
     }
-    conn->file_size = 0;
-    conn->bytes_sent = 0;
-
-    printf("Prepared error response: %d %s\n", conn->status_code, get_status_message(conn->status_code));
+    memcpy(response->data, header, header_len);
+    memcpy(response->data + header_len, body, body_len);
+    response->length = header_len + body_len;
+    response->header_len = header_len;
     return RESULT_OK;
 }
 
-enum result prepare_success_response(struct connection* conn) {
-    struct stat file_stat;
-
-    if (stat(conn->file_path, &file_stat) != 0) {
-        perror("stat failed");
-        conn->status_code = STATUS_NOT_FOUND;
-        return prepare_error_response(conn);
-    }
+enum result cache_build_response(struct cache_entry* entry, enum content_encoding encoding, const char* body, size_t body_len) {
+    struct cached_response* response = &entry->variants[encoding];
+    struct cached_response* not_modified = &entry->not_modified[encoding];
+    char header[RESPONSE_BUFFER_SIZE];
+    char last_modified[HTTP_DATE_MAX_LEN];
+    char content_encoding[64] = "";
+    char cache_control[CACHE_POLICY_MAX_LEN + 32] = "";
 
-    if (!S_ISREG(file_stat.st_mode)) {
-        fprintf(stderr, "Path is not a regular file: %s\n", conn->file_path);
-        conn->status_code = STATUS_NOT_FOUND;
-        return prepare_error_response(conn);
+    if (encoding != ENCODING_IDENTITY) {
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", encoding_names[encoding]);
     }
-
-    conn->file_size = file_stat.st_size;
-    conn->file_to_send = fopen(conn->file_path, "rb");
-
-    if (conn->file_to_send == NULL) {
-        perror("fopen failed");
-        conn->status_code = STATUS_INTERNAL_SERVER_ERROR;
-        return prepare_error_response(conn);
+    if (entry->cache_control != NULL) {
+        snprintf(cache_control, sizeof(cache_control), "Cache-Control: %s\r\n", entry->cache_control);
     }
+    format_http_date(entry->last_modified, last_modified, sizeof(last_modified));
+    snprintf(response->etag, sizeof(response->etag), "\"%016" PRIx64 "\"", hash_bytes(body, body_len));
 
-    conn->status_code = STATUS_OK;
-    int len = snprintf(conn->response_header_buffer, RESPONSE_BUFFER_SIZE,
-                       "HTTP/1.1 %d %s\r\n"
-                       "Content-Type: text/html\r\n"
-                       "Content-Length: %ld\r\n"
-                       "Connection: keep-alive\r\n\r\n",
-                       conn->status_code, get_status_message(conn->status_code),
-                       conn->file_size);
-
-    if (len < 0 || len >= RESPONSE_BUFFER_SIZE) {
-        fprintf(stderr, "Error formatting success response header.\n");
-        fclose(conn->file_to_send);
-        conn->file_to_send = NULL;
-        conn->status_code = STATUS_INTERNAL_SERVER_ERROR;
-
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %d %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "%s"
+                              "ETag: %s\r\n"
+                              "Last-Modified: %s\r\n"
+                              "%s"
+                              "Accept-Ranges: bytes\r\n"
+                              "Vary: Accept-Encoding\r\n\r\n",
+                              STATUS_OK, "OK", entry->mime_type->content_type, body_len, content_encoding, response->etag, last_modified,
+                              cache_control);
+    if (cache_store_response(response, header, header_len, body, body_len) != RESULT_OK) {
         return RESULT_ERR;
     }
-    conn->bytes_sent = 0;
-    conn->headers_sent = 0;
 
-    printf("Prepared success response for: %s (%ld bytes)\n", conn->file_path, conn->file_size);
-    return RESULT_OK;
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %d %s\r\n"
+                          "ETag: %s\r\n"
+                          "Last-Modified: %s\r\n"
+                          "%s"
+                          "Vary: Accept-Encoding\r\n\r\n",
+                          STATUS_NOT_MODIFIED, "Not Modified", response->etag, last_modified, cache_control);
+    return cache_store_response(not_modified, header, header_len, NULL, 0);
 }
 
-enum result send_response(struct connection* conn) {
-    ssize_t bytes_written;
-
-    if (!conn->headers_sent) {
-        size_t header_len = strlen(conn->response_header_buffer);
-        if (header_len > 0) {
-            bytes_written = write(conn->client_fd, conn->response_header_buffer, header_len);
-
-            if (bytes_written < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    return RESULT_ERR_AGAIN;
-                }
-                perror("write headers failed");
-                return RESULT_ERR;
-            }
-            if ((size_t)bytes_written < header_len) {
-                fprintf(stderr, "Partial write on headers for fd %d\n", conn->client_fd);
-                return RESULT_ERR;
-            }
+enum result cache_build_error_response(struct cached_response* response, int status_code) {
+    char file_path[FILE_PATH_MAX_LEN];
+    char header[RESPONSE_BUFFER_SIZE];
+    char default_body[ERRORRESPONSE_BUFFER_SIZE];
+    char extra_header[32] = "";
+    struct stat page_stat;
+    size_t body_len;
 
-            conn->headers_sent = 1;
-        } else {
-            fprintf(stderr, "Warning: No headers to send for fd %d\n", conn->client_fd);
-            conn->headers_sent = 1;
-        }
+    snprintf(file_path, sizeof(file_path), "%s/%d%s", BASE_ROUTE_PATH, status_code, ERROR_PAGE_SUFFIX);
+    char* body = read_file(file_path, &body_len, &page_stat);
+    if (body != NULL && body_len > CACHE_MAX_FILE_SIZE) {
+        log_warn("Ignoring %s: larger than %d bytes", file_path, CACHE_MAX_FILE_SIZE);
+        free(body);
+        body = NULL;
+    }
+    const char* page = body;
+    if (page == NULL) {
+        body_len = snprintf(default_body, sizeof(default_body), "<html><body><h1>%d %s</h1></body></html>",
+                            status_code, get_status_message(status_code));
+        page = default_body;
+    }
 
-        if (conn->file_to_send == NULL) {
-            if (conn->status_code != STATUS_OK) {
-                printf("Closing connection after sending error response for fd %d\n", conn->client_fd);
-                return RESULT_ERR;
-            } else {
-                return RESULT_OK;
-            }
-        }
+    if (status_code == STATUS_METHOD_NOT_ALLOWED) {
+        snprintf(extra_header, sizeof(extra_header), "Allow: GET\r\n");
+    } else if (status_code == STATUS_SERVICE_UNAVAILABLE) {
+        snprintf(extra_header, sizeof(extra_header), "Retry-After: %d\r\n", RETRY_AFTER_SECONDS);
     }
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %d %s\r\n"
+                              "Content-Type: text/html\r\n"
+                              "%s"
+                              "Content-Length: %zu\r\n\r\n",
+                              status_code, get_status_message(status_code), extra_header, body_len);
+    enum result res = cache_store_response(response, header, header_len, page, body_len);
+    free(body);
+    return res;
+}
 
-    if (conn->headers_sent && conn->file_to_send != NULL) {
-        size_t bytes_read = fread(conn->file_buffer, 1, FILE_BUFFER_SIZE, conn->file_to_send);
+struct route_bucket {
+    uint32_t index;
+    uint32_t start;
+    uint32_t size;
+};
 
-        if (bytes_read > 0) {
-            ssize_t total_written_this_chunk = 0;
-            while (total_written_this_chunk < bytes_read) {
-                bytes_written = write(conn->client_fd,
-                                      conn->file_buffer + total_written_this_chunk,
-                                      bytes_read - total_written_this_chunk);
+int route_bucket_compare(const void* a, const void* b) {
+    const struct route_bucket* left = a;
+    const struct route_bucket* right = b;
+    return (int)right->size - (int)left->size;
+}
 
-                if (bytes_written < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        if (fseek(conn->file_to_send, -total_written_this_chunk, SEEK_CUR) != 0) {
-                            perror("fseek failed after partial write attempt");
+uint32_t route_bucket(uint64_t hash, uint32_t bucket_mask) {
+    return (uint32_t)hash_finalize(hash) & bucket_mask;
+}
 
-                            return RESULT_ERR;
-                        }
+uint32_t route_slot(uint64_t hash, uint16_t displacement, uint32_t slot_mask) {
+    return (uint32_t)hash_finalize(hash + (displacement + 1ULL) * 0x9e3779b97f4a7c15ULL) & slot_mask;
+}
 
-                        return RESULT_ERR_AGAIN;
-                    }
-                    perror("write file content failed");
-                    return RESULT_ERR;
+enum result route_index_place(struct response_cache* cache, struct cache_entry** grouped, const struct route_bucket* buckets, uint32_t bucket_count) {
+    for (uint32_t i = 0; i < bucket_count && buckets[i].size > 0; ++i) {
+        struct cache_entry** entries = grouped + buckets[i].start;
+        uint32_t displacement = 0;
+        for (; displacement <= UINT16_MAX; ++displacement) {
+            uint32_t placed = 0;
+            for (; placed < buckets[i].size; ++placed) {
+                uint32_t slot = route_slot(entries[placed]->hash, displacement, cache->route_slot_mask);
+                if (cache->route_slots[slot] != NULL) {
+                    break;
                 }
-
-                total_written_this_chunk += bytes_written;
-                conn->bytes_sent += bytes_written;
+                cache->route_slots[slot] = entries[placed];
             }
-
-        } else {
-            if (ferror(conn->file_to_send)) {
-                perror("fread failed");
-                return RESULT_ERR;
+            if (placed == buckets[i].size) {
+                break;
             }
-
-            if (feof(conn->file_to_send)) {
-                if (conn->bytes_sent == conn->file_size) {
-                    printf("File sent completely for fd %d (%ld bytes).\n", conn->client_fd, conn->bytes_sent);
-                    return RESULT_OK;
-                } else {
-                    fprintf(stderr, "EOF reached but bytes sent (%ld) != file size (%ld) for fd %d\n",
-                            conn->bytes_sent, conn->file_size, conn->client_fd);
-                    return RESULT_ERR;
-                }
+            while (placed-- > 0) {
+                cache->route_slots[route_slot(entries[placed]->hash, displacement, cache->route_slot_mask)] = NULL;
             }
         }
+        if (displacement > UINT16_MAX) {
+            return RESULT_ERR;
+        }
+        cache->route_displacements[buckets[i].index] = displacement;
     }
+    return RESULT_OK;
+}
 
-    if (conn->headers_sent && conn->file_to_send != NULL && conn->bytes_sent < conn->file_size) {
-        return RESULT_ERR_AGAIN;
+enum result route_index_build(struct response_cache* cache) {
+    size_t count = cache->entry_count;
+
+    uint32_t bucket_count = 1;
+    while (bucket_count * ROUTE_BUCKET_LOAD < count) {
+        bucket_count <<= 1;
+    }
+    uint32_t slot_count = 2;
+    while (slot_count < count * 2) {
+        slot_count <<= 1;
     }
 
-    if (conn->headers_sent && conn->file_to_send == NULL) {
+    struct route_bucket* buckets = calloc(bucket_count, sizeof(*buckets));
+    struct cache_entry** grouped = malloc((count > 0 ? count : 1) * sizeof(*grouped));
+    cache->route_displacements = calloc(bucket_count, sizeof(*cache->route_displacements));
+    cache->route_bucket_mask = bucket_count - 1;
+    if (buckets == NULL || grouped == NULL || cache->route_displacements == NULL) {
+        free(buckets);
+        free(grouped);
         return RESULT_ERR;
     }
 
-    if (conn->file_to_send != NULL) {
-        return RESULT_ERR_AGAIN;
+    for (size_t i = 0; i < count; ++i) {
+        buckets[route_bucket(cache->entries[i]->hash, cache->route_bucket_mask)].size++;
+    }
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < bucket_count; ++i) {
+        buckets[i].index = i;
+        buckets[i].start = start;
+        start += buckets[i].size;
+        buckets[i].size = 0;
     }
+    for (size_t i = 0; i < count; ++i) {
+        struct route_bucket* bucket = &buckets[route_bucket(cache->entries[i]->hash, cache->route_bucket_mask)];
+        grouped[bucket->start + bucket->size++] = cache->entries[i];
+    }
+    qsort(buckets, bucket_count, sizeof(*buckets), route_bucket_compare);
 
-    return RESULT_OK;
+    enum result res = RESULT_ERR;
+    for (; slot_count <= ROUTE_MAX_SLOTS; slot_count <<= 1) {
+        free(cache->route_slots);
+        cache->route_slots = calloc(slot_count, sizeof(*cache->route_slots));
+        if (cache->route_slots == NULL) {
+            break;
+        }
+        cache->route_slot_mask = slot_count - 1;
+        if (route_index_place(cache, grouped, buckets, bucket_count) == RESULT_OK) {
+            res = RESULT_OK;
+            break;
+        }
+    }
+    free(buckets);
+    free(grouped);
+    return res;
+}
+
+const struct cache_entry* cache_lookup(const struct response_cache* cache, const char* uri, size_t uri_len) {
+    uint64_t hash = hash_bytes(uri, uri_len);
+    uint16_t displacement = cache->route_displacements[route_bucket(hash, cache->route_bucket_mask)];
+    const struct cache_entry* entry = cache->route_slots[route_slot(hash, displacement, cache->route_slot_mask)];
+    if (entry != NULL && entry->hash == hash && entry->uri_len == uri_len && memcmp(entry->uri, uri, uri_len) == 0) {
+        return entry;
+    }
+    return NULL;
+}
+
+uint64_t file_signature(uint64_t signature, const char* file_path) {
+    struct stat file_stat;
+    if (stat(file_path, &file_stat) != 0) {
+        return hash_mix(signature, 0);
+    }
+    signature = hash_mix(signature, (uint64_t)file_stat.st_ino);
+    signature = hash_mix(signature, (uint64_t)file_stat.st_size);
+    return hash_mix(signature, (uint64_t)file_stat.st_mtim.tv_sec * 1000000000ULL + file_stat.st_mtim.tv_nsec);
+}
+
+uint64_t page_signature(const char* file_path) {
+    uint64_t signature = file_signature(hash_bytes(file_path, strlen(file_path)), file_path);
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; ++encoding) {
+        char variant_path[FILE_PATH_MAX_LEN];
+        snprintf(variant_path, sizeof(variant_path), "%s%s", file_path, encoding_suffixes[encoding]);
+        signature = file_signature(signature, variant_path);
+    }
+    return signature;
+}
+
+enum result cache_append_entry(struct response_cache* cache, struct cache_entry* entry) {
+    if (cache->entry_count == cache->entry_capacity) {
+        size_t capacity = cache->entry_capacity > 0 ? cache->entry_capacity * 2 : 64;
+        struct cache_entry** entries = realloc(cache->entries, capacity * sizeof(*entries));
+        if (entries == NULL) {
+            cache_entry_release(entry);
+            return RESULT_ERR;
+        }
+        cache->entries = entries;
+        cache->entry_capacity = capacity;
+    }
+    cache->entries[cache->entry_count++] = entry;
+    return RESULT_OK;
+}
+
+void cache_load_page(struct cache_entry* entry) {
+    struct stat page_stat;
+    size_t body_len;
+    char* body = read_file(entry->file_path, &body_len, &page_stat);
+    if (body == NULL) {
+        log_errno("read failed while caching");
+        return;
+    }
+    entry->last_modified = page_stat.st_mtime;
+    if (cache_build_response(entry, ENCODING_IDENTITY, body, body_len) != RESULT_OK) {
+        log_error("Out of memory while caching %s", entry->file_path);
+        free(entry->variants[ENCODING_IDENTITY].data);
+        entry->variants[ENCODING_IDENTITY].data = NULL;
+        free(body);
+        return;
+    }
+
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; ++encoding) {
+        size_t variant_len;
+        char* variant = load_variant_body(encoding, entry->file_path, &page_stat, body, body_len, entry->mime_type->compressible, &variant_len);
+        if (variant != NULL && variant_len < body_len) {
+            cache_build_response(entry, encoding, variant, variant_len);
+        }
+        free(variant);
+    }
+    free(body);
+}
+
+int mime_type_compare(const void* key, const void* element) {
+    return strcasecmp(key, ((const struct mime_type*)element)->extension);
+}
+
+const char* file_extension(const char* file_path) {
+    const char* name = strrchr(file_path, '/');
+    const char* extension = strrchr(name != NULL ? name : file_path, '.');
+    return extension != NULL ? extension + 1 : NULL;
+}
+
+const struct mime_type* find_mime_type(const char* file_path) {
+    const char* extension = file_extension(file_path);
+    if (extension == NULL) {
+        return &default_mime_type;
+    }
+    const struct mime_type* mime_type = bsearch(extension, mime_types, sizeof(mime_types) / sizeof(mime_types[0]),
+                                                sizeof(mime_types[0]), mime_type_compare);
+    return mime_type != NULL ? mime_type : &default_mime_type;
+}
+
+int cache_policy_matches(const char* pattern, const char* uri, const char* file_path) {
+    if (strcmp(pattern, "*") == 0) {
+        return 1;
+    }
+    if (strncmp(pattern, "*.", 2) == 0) {
+        const char* extension = file_extension(file_path);
+        return extension != NULL && strcasecmp(extension, pattern + 2) == 0;
+    }
+    size_t pattern_len = strlen(pattern);
+    if (pattern_len > 1 && pattern[pattern_len - 1] == '/') {
+        return strncmp(uri, pattern, pattern_len) == 0 ||
+               (strlen(uri) == pattern_len - 1 && strncmp(uri, pattern, pattern_len - 1) == 0);
+    }
+    return strcmp(uri, pattern) == 0;
+}
+
+const char* cache_policy_lookup(const char* uri, const char* file_path) {
+    for (int i = 0; i < cache_policy_rule_count; ++i) {
+        if (cache_policy_matches(cache_policy_rules[i].pattern, uri, file_path)) {
+            return cache_policy_rules[i].value[0] != '\0' ? cache_policy_rules[i].value : NULL;
+        }
+    }
+    return NULL;
+}
+
+enum result cache_policy_parse_line(char* line, struct cache_policy_rule* rule) {
+    char* pattern = line + strspn(line, " \t");
+    size_t pattern_len = strcspn(pattern, " \t");
+    char* value = pattern + pattern_len + strspn(pattern + pattern_len, " \t");
+    size_t value_len = strlen(value);
+    while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+        --value_len;
+    }
+    if (pattern_len >= CACHE_POLICY_MAX_LEN || value_len == 0 || value_len >= CACHE_POLICY_MAX_LEN ||
+        (pattern[0] != '/' && pattern[0] != '*') || (pattern[0] == '*' && pattern_len > 1 && pattern[1] != '.')) {
+        return RESULT_ERR;
+    }
+    for (size_t i = 0; i < value_len; ++i) {
+        if (value[i] < ' ' || value[i] > '~') {
+            return RESULT_ERR;
+        }
+    }
+    memcpy(rule->pattern, pattern, pattern_len);
+    rule->pattern[pattern_len] = '\0';
+    if (value_len == 1 && value[0] == '-') {
+        value_len = 0;
+    }
+    memcpy(rule->value, value, value_len);
+    rule->value[value_len] = '\0';
+    return RESULT_OK;
+}
+
+enum result cache_policy_load(const char* path) {
+    FILE* file = fopen(path, "re");
+    if (file == NULL) {
+        log_error("Cannot open cache policy %s: %s", path, strerror(errno));
+        return RESULT_ERR;
+    }
+
+    char line[2 * CACHE_POLICY_MAX_LEN + 16];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ++line_number;
+        line[strcspn(line, "\r\n#")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') {
+            continue;
+        }
+        if (cache_policy_rule_count == CACHE_POLICY_MAX_RULES ||
+            cache_policy_parse_line(line, &cache_policy_rules[cache_policy_rule_count]) != RESULT_OK) {
+            log_error("%s:%d: invalid cache policy rule", path, line_number);
+            fclose(file);
+            return RESULT_ERR;
+        }
+        ++cache_policy_rule_count;
+    }
+    fclose(file);
+    log_info("Loaded %d cache policy rules from %s", cache_policy_rule_count, path);
+    return RESULT_OK;
+}
+
+enum result cache_add_page(struct response_cache* cache, const struct response_cache* previous,
+                           const char* uri, const char* file_path, const struct stat* file_stat) {
+    uint64_t signature = page_signature(file_path);
+    struct cache_entry* entry = previous != NULL ? (struct cache_entry*)cache_lookup(previous, uri, strlen(uri)) : NULL;
+    if (entry != NULL && entry->signature == signature) {
+        ++entry->refs;
+        return cache_append_entry(cache, entry);
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    char* entry_uri = strdup(uri);
+    char* entry_file_path = strdup(file_path);
+    if (entry == NULL || entry_uri == NULL || entry_file_path == NULL) {
+        log_error("Out of memory while caching %s", file_path);
+        free(entry);
+        free(entry_uri);
+        free(entry_file_path);
+        return RESULT_ERR;
+    }
+    entry->refs = 1;
+    entry->uri = entry_uri;
+    entry->uri_len = strlen(uri);
+    entry->hash = hash_bytes(uri, entry->uri_len);
+    entry->signature = signature;
+    entry->file_path = entry_file_path;
+    entry->mime_type = find_mime_type(file_path);
+    entry->cache_control = cache_policy_lookup(uri, file_path);
+    entry->last_modified = file_stat->st_mtime;
+    if (file_stat->st_size <= CACHE_MAX_FILE_SIZE) {
+        cache_load_page(entry);
+    }
+    log_debug("Cached %s", file_path);
+    return cache_append_entry(cache, entry);
+}
+
+int is_error_page_name(const char* name) {
+    for (int i = 0; i < ERROR_RESPONSE_COUNT; ++i) {
+        char error_page[16];
+        snprintf(error_page, sizeof(error_page), "%d%s", error_statuses[i], ERROR_PAGE_SUFFIX);
+        if (strcmp(name, error_page) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int is_precompressed_variant(const char* path, size_t path_len) {
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; ++encoding) {
+        size_t suffix_len = strlen(encoding_suffixes[encoding]);
+        if (path_len > suffix_len && strcmp(path + path_len - suffix_len, encoding_suffixes[encoding]) == 0) {
+            char base_path[FILE_PATH_MAX_LEN];
+            struct stat base_stat;
+            snprintf(base_path, sizeof(base_path), "%.*s", (int)(path_len - suffix_len), path);
+            return stat(base_path, &base_stat) == 0 && S_ISREG(base_stat.st_mode);
+        }
+    }
+    return 0;
+}
+
+void cache_scan_directory(struct response_cache* cache, const struct response_cache* previous, char* path, size_t path_len, uint64_t* signature) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    if (cache != NULL && cache_watch_fd >= 0 && inotify_add_watch(cache_watch_fd, path, CACHE_WATCH_MASK) < 0) {
+        log_warn("Cannot watch %s: %s", path, strerror(errno));
+    }
+
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        if (dirent->d_name[0] == '.') {
+            continue;
+        }
+
+        int len = snprintf(path + path_len, FILE_PATH_MAX_LEN - path_len, "/%s", dirent->d_name);
+        if (len < 0 || (size_t)len >= FILE_PATH_MAX_LEN - path_len) {
+            continue;
+        }
+
+        struct stat file_stat;
+        if (stat(path, &file_stat) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(file_stat.st_mode)) {
+            cache_scan_directory(cache, previous, path, path_len + len, signature);
+        } else if (S_ISREG(file_stat.st_mode)) {
+            *signature = hash_mix(*signature, hash_bytes(path, path_len + len));
+            *signature = hash_mix(*signature, (uint64_t)file_stat.st_ino);
+            *signature = hash_mix(*signature, (uint64_t)file_stat.st_size);
+            *signature = hash_mix(*signature, (uint64_t)file_stat.st_mtim.tv_sec * 1000000000ULL + file_stat.st_mtim.tv_nsec);
+
+            if (cache == NULL || (path_len == strlen(BASE_ROUTE_PATH) && is_error_page_name(dirent->d_name)) ||
+                is_precompressed_variant(path, path_len + len)) {
+                continue;
+            }
+            if (strcmp(dirent->d_name, ROUTE_PAGE_NAME) == 0) {
+                char file_path[FILE_PATH_MAX_LEN];
+                memcpy(file_path, path, path_len + len + 1);
+                path[path_len] = '\0';
+                const char* uri = path_len > strlen(BASE_ROUTE_PATH) ? path + strlen(BASE_ROUTE_PATH) : "/";
+                cache_add_page(cache, previous, uri, file_path, &file_stat);
+            } else {
+                cache_add_page(cache, previous, path + strlen(BASE_ROUTE_PATH), path, &file_stat);
+            }
+        }
+    }
+    path[path_len] = '\0';
+    closedir(dir);
+}
+
+uint64_t cache_scan_signature() {
+    char path[FILE_PATH_MAX_LEN];
+    uint64_t signature = 0;
+    snprintf(path, sizeof(path), "%s", BASE_ROUTE_PATH);
+    cache_scan_directory(NULL, NULL, path, strlen(path), &signature);
+    return signature;
+}
+
+struct response_cache* cache_build(const struct response_cache* previous) {
+    struct response_cache* cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        log_error("Out of memory while building response cache");
+        return NULL;
+    }
+
+    char path[FILE_PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s", BASE_ROUTE_PATH);
+    cache_scan_directory(cache, previous, path, strlen(path), &cache->signature);
+
+    if (route_index_build(cache) != RESULT_OK) {
+        log_error("Out of memory while building route index");
+        cache_free(cache);
+        return NULL;
+    }
+    for (int i = 0; i < ERROR_RESPONSE_COUNT; ++i) {
+        if (cache_build_error_response(&cache->errors[i], error_statuses[i]) != RESULT_OK) {
+            log_error("Out of memory while building error responses");
+            cache_free(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+struct bundle_response {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t header_len;
+    char etag[ETAG_MAX_LEN];
+};
+
+struct bundle_route {
+    uint64_t hash;
+    uint64_t uri_offset;
+    uint64_t uri_len;
+    int64_t last_modified;
+    struct bundle_response variants[ENCODING_COUNT];
+    struct bundle_response not_modified[ENCODING_COUNT];
+};
+
+struct bundle_header {
+    char magic[8];
+    uint64_t route_count;
+    uint64_t signature;
+    uint64_t size;
+    struct bundle_response errors[ERROR_RESPONSE_COUNT];
+};
+
+int route_uri_compare(const void* a, const void* b) {
+    const struct cache_entry* left = *(const struct cache_entry* const*)a;
+    const struct cache_entry* right = *(const struct cache_entry* const*)b;
+    return strcmp(left->uri, right->uri);
+}
+
+uint64_t bundle_append(FILE* out, const char* data, size_t len, uint64_t* size) {
+    uint64_t offset = *size;
+    fwrite(data, 1, len, out);
+    *size += len;
+    return offset;
+}
+
+void bundle_append_response(FILE* out, const struct cached_response* response, struct bundle_response* record, uint64_t* size) {
+    if (response->data == NULL) {
+        return;
+    }
+    record->offset = bundle_append(out, response->data, response->length, size);
+    record->length = response->length;
+    record->header_len = response->header_len;
+    memcpy(record->etag, response->etag, sizeof(record->etag));
+}
+
+enum result bundle_write(FILE* out, struct response_cache* cache) {
+    struct bundle_header header;
+    struct bundle_route* routes = calloc(cache->entry_count > 0 ? cache->entry_count : 1, sizeof(*routes));
+    if (routes == NULL) {
+        return RESULT_ERR;
+    }
+    qsort(cache->entries, cache->entry_count, sizeof(*cache->entries), route_uri_compare);
+
+    uint64_t size = sizeof(header) + cache->entry_count * sizeof(*routes);
+    fseek(out, (long)size, SEEK_SET);
+    for (size_t i = 0; i < cache->entry_count; ++i) {
+        struct cache_entry* entry = cache->entries[i];
+        if (entry->variants[ENCODING_IDENTITY].data == NULL) {
+            cache_load_page(entry);
+        }
+        routes[i].hash = entry->hash;
+        routes[i].uri_len = entry->uri_len;
+        routes[i].uri_offset = bundle_append(out, entry->uri, entry->uri_len + 1, &size);
+        routes[i].last_modified = entry->last_modified;
+        for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+            bundle_append_response(out, &entry->variants[encoding], &routes[i].variants[encoding], &size);
+            bundle_append_response(out, &entry->not_modified[encoding], &routes[i].not_modified[encoding], &size);
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.route_count = cache->entry_count;
+    header.signature = cache->signature;
+    for (int i = 0; i < ERROR_RESPONSE_COUNT; ++i) {
+        bundle_append_response(out, &cache->errors[i], &header.errors[i], &size);
+    }
+    header.size = size;
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(routes, sizeof(*routes), cache->entry_count, out);
+    free(routes);
+    return ferror(out) ? RESULT_ERR : RESULT_OK;
+}
+
+enum result bundle_pack(const char* path) {
+    char tmp_path[FILE_PATH_MAX_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    struct response_cache* cache = cache_build(NULL);
+    if (cache == NULL) {
+        return RESULT_ERR;
+    }
+    FILE* out = fopen(tmp_path, "wbe");
+    if (out == NULL) {
+        log_error("Cannot create %s: %s", tmp_path, strerror(errno));
+        cache_free(cache);
+        return RESULT_ERR;
+    }
+
+    enum result res = bundle_write(out, cache);
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        res = RESULT_ERR;
+    }
+    if (fclose(out) != 0 || res != RESULT_OK || rename(tmp_path, path) != 0) {
+        log_errno("bundle write failed");
+        unlink(tmp_path);
+        cache_free(cache);
+        return RESULT_ERR;
+    }
+    log_info("Packed %zu routes into %s", cache->entry_count, path);
+    cache_free(cache);
+    return RESULT_OK;
+}
+
+int bundle_response_valid(const struct bundle_response* record, uint64_t size) {
+    return record->length == 0 ||
+           (record->offset <= size && record->length <= size - record->offset && record->header_len <= record->length);
+}
+
+void bundle_map_response(struct cached_response* response, char* base, const struct bundle_response* record) {
+    if (record->length == 0) {
+        return;
+    }
+    response->data = base + record->offset;
+    response->length = record->length;
+    response->header_len = record->header_len;
+    memcpy(response->etag, record->etag, sizeof(response->etag));
+    response->etag[ETAG_MAX_LEN - 1] = '\0';
+}
+
+enum result bundle_map_routes(struct response_cache* cache, const struct bundle_header* header) {
+    char* base = cache->bundle;
+    const struct bundle_route* routes = (const struct bundle_route*)(header + 1);
+
+    for (uint64_t i = 0; i < header->route_count; ++i) {
+        const struct bundle_route* route = &routes[i];
+        struct cache_entry* entry = &cache->bundle_entries[i];
+        if (route->uri_offset >= header->size || route->uri_len >= header->size - route->uri_offset ||
+            base[route->uri_offset + route->uri_len] != '\0' || route->variants[ENCODING_IDENTITY].length == 0) {
+            return RESULT_ERR;
+        }
+        entry->refs = 1;
+        entry->hash = route->hash;
+        entry->uri = base + route->uri_offset;
+        entry->uri_len = route->uri_len;
+        entry->last_modified = (time_t)route->last_modified;
+        for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+            if (!bundle_response_valid(&route->variants[encoding], header->size) ||
+                !bundle_response_valid(&route->not_modified[encoding], header->size)) {
+                return RESULT_ERR;
+            }
+            bundle_map_response(&entry->variants[encoding], base, &route->variants[encoding]);
+            bundle_map_response(&entry->not_modified[encoding], base, &route->not_modified[encoding]);
+        }
+        cache->entries[i] = entry;
+    }
+    cache->entry_count = header->route_count;
+
+    for (int i = 0; i < ERROR_RESPONSE_COUNT; ++i) {
+        if (header->errors[i].length == 0 || !bundle_response_valid(&header->errors[i], header->size)) {
+            return RESULT_ERR;
+        }
+        bundle_map_response(&cache->errors[i], base, &header->errors[i]);
+    }
+    return route_index_build(cache);
+}
+
+struct response_cache* bundle_map(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Cannot open bundle %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    struct stat bundle_stat;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &bundle_stat) == 0 && (size_t)bundle_stat.st_size >= sizeof(struct bundle_header)) {
+        base = mmap(NULL, bundle_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        log_error("Cannot map bundle %s", path);
+        return NULL;
+    }
+
+    const struct bundle_header* header = base;
+    size_t size = bundle_stat.st_size;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->size != size ||
+        header->route_count > (size - sizeof(*header)) / sizeof(struct bundle_route)) {
+        log_error("%s is not a route bundle", path);
+        munmap(base, size);
+        return NULL;
+    }
+
+    struct response_cache* cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        log_error("Out of memory while mapping bundle");
+        munmap(base, size);
+        return NULL;
+    }
+    cache->bundle = base;
+    cache->bundle_len = size;
+    cache->signature = header->signature;
+    cache->bundle_entries = calloc(header->route_count > 0 ? header->route_count : 1, sizeof(*cache->bundle_entries));
+    cache->entries = calloc(header->route_count > 0 ? header->route_count : 1, sizeof(*cache->entries));
+    cache->entry_capacity = header->route_count;
+    if (cache->bundle_entries == NULL || cache->entries == NULL || bundle_map_routes(cache, header) != RESULT_OK) {
+        log_error("Cannot load bundle %s", path);
+        cache_free(cache);
+        return NULL;
+    }
+    log_info("Mapped %zu routes from %s", cache->entry_count, path);
+    return cache;
+}
+
+struct response_cache* cache_load(const struct response_cache* previous) {
+    return config.bundle_path != NULL ? bundle_map(config.bundle_path) : cache_build(previous);
+}
+
+void cache_pin(struct response_cache* cache) {
+    struct cache_pin* pin = &cache->pins[current_worker->id];
+    atomic_store_explicit(&pin->count, atomic_load_explicit(&pin->count, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void cache_unpin(struct response_cache* cache) {
+    struct cache_pin* pin = &cache->pins[current_worker->id];
+    atomic_store_explicit(&pin->count, atomic_load_explicit(&pin->count, memory_order_relaxed) - 1, memory_order_release);
+}
+
+void cache_worker_online(struct worker* worker) {
+    atomic_store(&worker->epoch, atomic_load(&response_cache_epoch));
+}
+
+void cache_worker_offline(struct worker* worker) {
+    atomic_store(&worker->epoch, 0);
+}
+
+int cache_is_reclaimable(struct response_cache* cache) {
+    for (int i = 0; i < config.worker_count; ++i) {
+        uint64_t epoch = atomic_load(&workers[i].epoch);
+        if (epoch != 0 && epoch <= cache->retire_epoch) {
+            return 0;
+        }
+        if (atomic_load_explicit(&cache->pins[i].count, memory_order_acquire) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void cache_publish(struct response_cache* cache) {
+    struct response_cache* old = atomic_exchange(&response_cache_current, cache);
+    if (old != NULL) {
+        old->retire_epoch = atomic_fetch_add(&response_cache_epoch, 1);
+        old->retired_next = response_cache_retired;
+        response_cache_retired = old;
+    }
+}
+
+void cache_reclaim() {
+    struct response_cache** ptr = &response_cache_retired;
+    while (*ptr != NULL) {
+        struct response_cache* cache = *ptr;
+        if (cache_is_reclaimable(cache)) {
+            *ptr = cache->retired_next;
+            cache_free(cache);
+        } else {
+            ptr = &cache->retired_next;
+        }
+    }
+}
+
+void cache_watch_open() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    cache_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (config.bundle_path != NULL) {
+        return;
+    }
+
+    cache_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache_watch_fd < 0) {
+        log_warn("inotify unavailable (%s), polling %s every %d seconds", strerror(errno), BASE_ROUTE_PATH, CACHE_REFRESH_INTERVAL);
+    }
+}
+
+int cache_take_reload_signal() {
+    struct signalfd_siginfo info;
+    int pending = 0;
+    while (cache_signal_fd >= 0 && read(cache_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        pending = 1;
+    }
+    return pending;
+}
+
+int cache_wait_for_changes() {
+    int polling = config.bundle_path == NULL && cache_watch_fd < 0;
+    int timeout_ms = polling ? CACHE_REFRESH_INTERVAL * 1000 : response_cache_retired != NULL ? CACHE_RECLAIM_INTERVAL_MS : -1;
+    struct pollfd pfds[2] = {{cache_signal_fd, POLLIN, 0}, {cache_watch_fd, POLLIN, 0}};
+
+    int ready = poll(pfds, 2, timeout_ms);
+    if (cache_take_reload_signal()) {
+        return 1;
+    }
+    if (polling) {
+        struct response_cache* current = atomic_load(&response_cache_current);
+        return current == NULL || cache_scan_signature() != current->signature;
+    }
+    if (ready <= 0 || !(pfds[1].revents & POLLIN)) {
+        return 0;
+    }
+    do {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        while (read(cache_watch_fd, events, sizeof(events)) > 0) {
+        }
+    } while (poll(&pfds[1], 1, CACHE_SETTLE_MS) > 0);
+    return 1;
+}
+
+void* cache_refresh_main(void* arg) {
+    (void)arg;
+    while (1) {
+        if (cache_wait_for_changes()) {
+            struct response_cache* current = atomic_load(&response_cache_current);
+            struct response_cache* cache = cache_load(current);
+            if (cache != NULL && current != NULL && cache->signature == current->signature) {
+                cache_free(cache);
+            } else if (cache != NULL) {
+                cache_publish(cache);
+                log_info("Response cache refreshed");
+            }
+        }
+        cache_reclaim();
+    }
+    return NULL;
+}
+
+uint64_t monotonic_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void access_log_request(struct connection* conn) {
+    struct access_log_ring* ring = current_worker->access_log;
+    if (ring == NULL) {
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ACCESS_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct access_log_record* record = &ring->records[head & (ACCESS_LOG_RING_SIZE - 1)];
+    const struct http_request* req = &conn->buffer->request;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    record->time = now.tv_sec;
+    record->latency_us = (monotonic_nanoseconds() - conn->request_start) / 1000;
+    record->status = conn->status_code;
+    record->bytes = conn->bytes_sent;
+    record->method_len = req->method.length < sizeof(record->method) ? req->method.length : sizeof(record->method);
+    memcpy(record->method, conn->buffer->request_buffer + req->method.offset, record->method_len);
+    record->uri_len = req->path.length < ACCESS_LOG_URI_MAX_LEN ? req->path.length : ACCESS_LOG_URI_MAX_LEN;
+    memcpy(record->uri, conn->buffer->request_buffer + req->path.offset, record->uri_len);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void counter_add(_Atomic unsigned long* counter, unsigned long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+int histogram_bucket(uint64_t microseconds) {
+    if (microseconds < 1 << HISTOGRAM_SUB_BITS) {
+        return (int)microseconds;
+    }
+    int shift = 63 - __builtin_clzll(microseconds) - HISTOGRAM_SUB_BITS;
+    int bucket = ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((microseconds >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+    return bucket < HISTOGRAM_BUCKET_COUNT ? bucket : HISTOGRAM_BUCKET_COUNT - 1;
+}
+
+uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < 1 << HISTOGRAM_SUB_BITS) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1ULL << HISTOGRAM_SUB_BITS) + sub_bucket + 1) << shift) - 1;
+}
+
+void histogram_record(struct latency_histogram* histogram, uint64_t nanoseconds) {
+    uint64_t microseconds = nanoseconds / 1000;
+    counter_add(&histogram->buckets[histogram_bucket(microseconds)], 1);
+    counter_add(&histogram->sum_us, microseconds);
+}
+
+const int metrics_statuses[METRICS_STATUS_COUNT - 1] = {
+    STATUS_OK,
+    STATUS_PARTIAL_CONTENT,
+    STATUS_NOT_MODIFIED,
+    STATUS_BAD_REQUEST,
+    STATUS_NOT_FOUND,
+    STATUS_METHOD_NOT_ALLOWED,
+    STATUS_CONTENT_TOO_LARGE,
+    STATUS_URI_TOO_LONG,
+    STATUS_RANGE_NOT_SATISFIABLE,
+    STATUS_HEADER_FIELDS_TOO_LARGE,
+    STATUS_INTERNAL_SERVER_ERROR,
+    STATUS_SERVICE_UNAVAILABLE
+};
+
+int metrics_status_index(int status_code) {
+    for (int i = 0; i < METRICS_STATUS_COUNT - 1; ++i) {
+        if (metrics_statuses[i] == status_code) {
+            return i;
+        }
+    }
+    return METRICS_STATUS_COUNT - 1;
+}
+
+void metrics_request(struct connection* conn) {
+    struct worker_metrics* metrics = &current_worker->metrics;
+    counter_add(&metrics->responses[metrics_status_index(conn->status_code)], 1);
+    counter_add(&metrics->bytes_sent, conn->bytes_sent);
+    if (request_timing) {
+        histogram_record(&metrics->response_latency, monotonic_nanoseconds() - conn->request_start);
+    }
+}
+
+void access_log_write(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t bytes_written = write(access_log_fd, data, len);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("access log write failed");
+            return;
+        }
+        data += bytes_written;
+        len -= bytes_written;
+    }
+}
+
+void access_log_flush() {
+    static char batch[ACCESS_LOG_BATCH_SIZE];
+    size_t len = 0;
+    char date[HTTP_DATE_MAX_LEN];
+    time_t date_time = -1;
+
+    for (int i = 0; i < config.worker_count; ++i) {
+        struct access_log_ring* ring = workers[i].access_log;
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            log_warn("Access log full on worker %d, dropped %lu records", i, dropped);
+        }
+
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; ++tail) {
+            const struct access_log_record* record = &ring->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+            if (sizeof(batch) - len < LOG_LINE_MAX_LEN) {
+                access_log_write(batch, len);
+                len = 0;
+            }
+            if (record->time != date_time) {
+                struct tm tm;
+                gmtime_r(&record->time, &tm);
+                strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+                date_time = record->time;
+            }
+            len += snprintf(batch + len, sizeof(batch) - len,
+                            "time=%s method=%.*s uri=%.*s status=%u bytes=%ld latency_us=%" PRIu32 "\n",
+                            date, record->method_len, record->method, record->uri_len, record->uri,
+                            record->status, record->bytes, record->latency_us);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    if (len > 0) {
+        access_log_write(batch, len);
+    }
+}
+
+void* access_log_main(void* arg) {
+    (void)arg;
+    while (1) {
+        usleep(ACCESS_LOG_FLUSH_INTERVAL_MS * 1000);
+        access_log_flush();
+    }
+    return NULL;
+}
+
+enum result access_log_open() {
+    if (strcmp(config.access_log_path, "off") == 0) {
+        return RESULT_OK;
+    }
+    if (strcmp(config.access_log_path, "-") == 0) {
+        access_log_fd = STDOUT_FILENO;
+    } else {
+        access_log_fd = open(config.access_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (access_log_fd < 0) {
+            log_errno("open access log failed");
+            return RESULT_ERR;
+        }
+    }
+
+    for (int i = 0; i < config.worker_count; ++i) {
+        workers[i].access_log = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct access_log_ring));
+        if (workers[i].access_log == NULL) {
+            log_error("Out of memory while allocating access log");
+            return RESULT_ERR;
+        }
+        memset(workers[i].access_log, 0, sizeof(struct access_log_ring));
+    }
+    return RESULT_OK;
+}
+
+enum result grow_connection_pool() {
+    int count = connection_limit - connection_allocated;
+    if (count > CONNECTION_SLAB_SIZE) {
+        count = CONNECTION_SLAB_SIZE;
+    }
+    if (count <= 0) {
+        return RESULT_ERR;
+    }
+
+    struct connection_slot* slots = realloc(connection_slots, (connection_allocated + count) * sizeof(struct connection_slot));
+    if (slots == NULL) {
+        log_error("Out of memory while growing connection pool");
+        return RESULT_ERR;
+    }
+    connection_slots = slots;
+
+    struct connection* slab = calloc(count, sizeof(struct connection));
+    if (slab == NULL) {
+        log_error("Out of memory while growing connection pool");
+        return RESULT_ERR;
+    }
+    for (int i = count - 1; i >= 0; --i) {
+        slab[i].client_fd = -1;
+        slab[i].file_fd = -1;
+        slab[i].next = connection_free;
+        connection_free = &slab[i];
+    }
+    connection_allocated += count;
+    log_debug("Connection pool grown to %d connections", connection_allocated);
+    return RESULT_OK;
+}
+
+void initialize_connection_pool() {
+    connection_free = NULL;
+    connection_active_count = 0;
+    connection_allocated = 0;
+    connection_limit = (config.max_connections + config.worker_count - 1) / config.worker_count;
+    grow_connection_pool();
+}
+
+enum result borrow_connection_buffer(struct connection* conn) {
+    struct connection_buffer* buffer = connection_buffer_free;
+    if (buffer != NULL) {
+        connection_buffer_free = buffer->next;
+    } else {
+        buffer = malloc(sizeof(struct connection_buffer));
+        if (buffer == NULL) {
+            log_error("Out of memory while allocating connection buffer");
+            return RESULT_ERR;
+        }
+    }
+
+    conn->buffer = buffer;
+    return RESULT_OK;
+}
+
+void return_connection_buffer(struct connection* conn) {
+    conn->buffer->next = connection_buffer_free;
+    connection_buffer_free = conn->buffer;
+    conn->buffer = NULL;
+}
+
+void timer_insert(struct connection* conn) {
+    uint64_t delta = conn->timer_expires - timer_tick;
+    if (delta >= 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) {
+        delta = (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        conn->timer_expires = timer_tick + delta;
+    }
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ULL << (TIMER_WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+
+    struct connection** slot = &timer_wheel[level][(conn->timer_expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SIZE - 1)];
+    conn->timer_next = *slot;
+    conn->timer_prev = slot;
+    if (*slot != NULL) {
+        (*slot)->timer_prev = &conn->timer_next;
+    }
+    *slot = conn;
+}
+
+void timer_remove(struct connection* conn) {
+    if (conn->timer_prev == NULL) {
+        return;
+    }
+    *conn->timer_prev = conn->timer_next;
+    if (conn->timer_next != NULL) {
+        conn->timer_next->timer_prev = conn->timer_prev;
+    }
+    conn->timer_next = NULL;
+    conn->timer_prev = NULL;
+    --timer_count;
+}
+
+void connection_set_timeout(struct connection* conn, int seconds) {
+    timer_remove(conn);
+    conn->timer_expires = loop_tick + (uint64_t)seconds * (1000 / TIMER_TICK_MS);
+    if (conn->timer_expires <= timer_tick) {
+        conn->timer_expires = timer_tick + 1;
+    }
+    timer_insert(conn);
+    ++timer_count;
+}
+
+int timer_wait_timeout() {
+    if (timer_count == 0) {
+        return -1;
+    }
+    uint64_t tick = timer_tick + 1;
+    while (timer_wheel[0][tick & (TIMER_WHEEL_SIZE - 1)] == NULL && (tick & (TIMER_WHEEL_SIZE - 1)) != 0) {
+        ++tick;
+    }
+    return (int)(tick - timer_tick) * TIMER_TICK_MS;
+}
+
+void start_request(struct connection* conn) {
+    connection_set_timeout(conn, config.request_timeout);
+    if (request_timing) {
+        conn->request_start = monotonic_nanoseconds();
+        if (conn->requests_served == 0) {
+            histogram_record(&current_worker->metrics.first_byte_latency, conn->request_start - conn->accepted_at);
+        }
+    }
+}
+
+enum result admission_acquire(uint32_t address, struct admission_slot** acquired) {
+    uint32_t start = (uint32_t)hash_finalize(address);
+    struct admission_slot* vacant = NULL;
+
+    *acquired = NULL;
+    for (int i = 0; i < ADMISSION_PROBE_LIMIT; ++i) {
+        struct admission_slot* slot = &admission_table[(start + i) & (ADMISSION_TABLE_SIZE - 1)];
+        uint64_t owner = atomic_load_explicit(&slot->owner, memory_order_relaxed);
+        while ((owner >> 32) == address) {
+            if (config.ip_connections > 0 && (uint32_t)owner >= (uint32_t)config.ip_connections) {
+                return RESULT_ERR;
+            }
+            if (atomic_compare_exchange_weak_explicit(&slot->owner, &owner, owner + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *acquired = slot;
+                return RESULT_OK;
+            }
+        }
+        if (vacant == NULL && (uint32_t)owner == 0) {
+            vacant = slot;
+        }
+    }
+
+    if (vacant != NULL) {
+        uint64_t owner = atomic_load_explicit(&vacant->owner, memory_order_relaxed);
+        if ((uint32_t)owner == 0 && atomic_compare_exchange_strong_explicit(&vacant->owner, &owner, (uint64_t)address << 32 | 1,
+                                                                            memory_order_relaxed, memory_order_relaxed)) {
+            atomic_store_explicit(&vacant->rate, 0, memory_order_relaxed);
+            *acquired = vacant;
+        }
+    }
+    return RESULT_OK;
+}
+
+void admission_release(struct admission_slot* slot) {
+    if (slot != NULL) {
+        atomic_fetch_sub_explicit(&slot->owner, 1, memory_order_relaxed);
+    }
+}
+
+int admission_allow_request(struct admission_slot* slot) {
+    uint64_t second = (loop_tick / (1000 / TIMER_TICK_MS)) & UINT32_MAX;
+    uint64_t rate = atomic_load_explicit(&slot->rate, memory_order_relaxed);
+    while (1) {
+        int current = (rate >> 32) == second;
+        if (current && (uint32_t)rate >= (uint32_t)config.ip_rate) {
+            return 0;
+        }
+        uint64_t next = current ? rate + 1 : second << 32 | 1;
+        if (atomic_compare_exchange_weak_explicit(&slot->rate, &rate, next, memory_order_relaxed, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+}
+
+enum result admit_connection(int client_fd, struct admission_slot** admission) {
+    *admission = NULL;
+    if (config.ip_connections == 0 && config.ip_rate == 0) {
+        return RESULT_OK;
+    }
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(client_fd, (struct sockaddr*)&peer, &peer_len) != 0 || peer.sin_family != AF_INET) {
+        return RESULT_OK;
+    }
+    return admission_acquire(ntohl(peer.sin_addr.s_addr), admission);
+}
+
+void reject_connection(int client_fd) {
+    int respond = config.overload != OVERLOAD_CLOSE;
+#ifdef WITH_TLS
+    respond = respond && tls_ctx == NULL;
+#endif
+    counter_add(&current_worker->metrics.rejects, 1);
+    if (respond) {
+        static const char connection_close[] = "Connection: close\r\n\r\n";
+        char discard[REQUEST_BUFFER_SIZE];
+        const struct response_cache* cache = atomic_load_explicit(&response_cache_current, memory_order_acquire);
+        const struct cached_response* response = &cache->errors[error_response_index(STATUS_SERVICE_UNAVAILABLE)];
+        struct iovec iov[3] = {
+            {response->data, response->header_len - 2},
+            {(void*)connection_close, sizeof(connection_close) - 1},
+            {response->data + response->header_len, response->length - response->header_len},
+        };
+        ssize_t ignored = recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT);
+        ignored = writev(client_fd, iov, 3);
+        (void)ignored;
+    }
+    close(client_fd);
+}
+
+int connection_pool_full() {
+    return connection_active_count >= connection_limit;
+}
+
+struct connection* get_free_connection(int client_fd) {
+    if (connection_free == NULL && grow_connection_pool() != RESULT_OK) {
+        return NULL;
+    }
+    struct connection* conn = connection_free;
+    connection_free = conn->next;
+
+    int nodelay = 1;
+    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+        log_debug("setsockopt(TCP_NODELAY) failed: %s", strerror(errno));
+    }
+
+    conn->slot = connection_active_count++;
+    connection_slots[conn->slot].conn = conn;
+
+    conn->client_fd = client_fd;
+    conn->state = CONNECTION_READING;
+    conn->request_len = 0;
+    conn->request_end = 0;
+    conn->keep_alive = 0;
+    conn->requests_served = 0;
+    conn->accepted_at = request_timing ? monotonic_nanoseconds() : 0;
+    conn->request_start = 0;
+    conn->file_fd = -1;
+    conn->file_offset = 0;
+    conn->file_end = 0;
+    conn->bytes_sent = 0;
+    conn->response_header_len = 0;
+    conn->status_code = STATUS_OK;
+    conn->cache = NULL;
+    conn->cached_response = NULL;
+    conn->admission = NULL;
+    conn->buffer = NULL;
+    connection_set_timeout(conn, config.keepalive_timeout);
+    counter_add(&current_worker->metrics.accepts, 1);
+#ifdef WITH_TLS
+    conn->tls = NULL;
+    conn->tls_kernel_send = 0;
+#endif
+#ifdef WITH_IO_URING
+    conn->uring_starved_next = NULL;
+    conn->uring_pending = 0;
+    conn->uring_flags = 0;
+    conn->uring_held_head = URING_NO_BUFFER;
+    conn->uring_held_tail = URING_NO_BUFFER;
+    conn->uring_held_offset = 0;
+    conn->uring_held_count = 0;
+#endif
+
+    return conn;
+}
+
+void discard_unread_input(struct connection* conn) {
+    char discard[REQUEST_BUFFER_SIZE];
+    size_t discarded = 0;
+    ssize_t n;
+
+    if (conn->status_code < STATUS_BAD_REQUEST) {
+        return;
+    }
+    while (discarded < DISCARD_INPUT_MAX && (n = recv(conn->client_fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0) {
+        discarded += n;
+    }
+}
+
+void release_connection(struct connection* conn) {
+    if (conn == NULL)
+        return;
+
+    if (conn->request_end > 0) {
+        access_log_request(conn);
+        metrics_request(conn);
+    }
+    timer_remove(conn);
+    admission_release(conn->admission);
+    conn->admission = NULL;
+
+    struct connection_slot* last = &connection_slots[--connection_active_count];
+    connection_slots[conn->slot] = *last;
+    last->conn->slot = conn->slot;
+
+    conn->next = connection_free;
+    connection_free = conn;
+
+#ifdef WITH_TLS
+    if (conn->tls != NULL) {
+        if (SSL_is_init_finished(conn->tls)) {
+            SSL_shutdown(conn->tls);
+        }
+        SSL_free(conn->tls);
+        conn->tls = NULL;
+        ERR_clear_error();
+    }
+#endif
+    if (conn->client_fd != -1) {
+        close(conn->client_fd);
+        conn->client_fd = -1;
+    }
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    if (conn->cache != NULL) {
+        cache_unpin(conn->cache);
+        conn->cache = NULL;
+        conn->cached_response = NULL;
+    }
+    if (conn->buffer != NULL) {
+        return_connection_buffer(conn);
+    }
+}
+
+enum result set_connection_state(struct connection* conn, enum connection_state state) {
+    if (conn->state == state) {
+        return RESULT_OK;
+    }
+    conn->state = state;
+    if (state == CONNECTION_WRITING) {
+        connection_set_timeout(conn, config.send_timeout);
+    }
+
+    int interest = state == CONNECTION_WRITING ? EVENT_WRITE : EVENT_READ;
+    return event_backend_modify(conn->client_fd, interest, conn, 1);
+}
+
+#ifdef WITH_IO_URING
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring* buffer_ring;
+    char* buffers;
+    uint16_t buffer_tail;
+    int buffers_recycled;
+    uint16_t buffer_next[URING_BUFFER_COUNT];
+    uint16_t buffer_len[URING_BUFFER_COUNT];
+    struct connection* starved;
+};
+
+__thread struct uring uring = {.fd = -1};
+
+uint64_t uring_user_data(void* target, enum uring_op op) {
+    return (uint64_t)(uintptr_t)target | op;
+}
+
+void uring_cleanup() {
+    if (uring.buffers != NULL) {
+        free(uring.buffers);
+        uring.buffers = NULL;
+    }
+    if (uring.buffer_ring != NULL) {
+        munmap(uring.buffer_ring, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+        uring.buffer_ring = NULL;
+    }
+    if (uring.sqes != NULL) {
+        munmap(uring.sqes, uring.sqes_size);
+        uring.sqes = NULL;
+    }
+    if (uring.cq_ring != NULL && uring.cq_ring != uring.sq_ring) {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    if (uring.sq_ring != NULL) {
+        munmap(uring.sq_ring, uring.sq_ring_size);
+    }
+    uring.sq_ring = NULL;
+    uring.cq_ring = NULL;
+    if (uring.fd != -1) {
+        close(uring.fd);
+        uring.fd = -1;
+    }
+}
+
+void uring_recycle_buffer(uint16_t bid) {
+    struct io_uring_buf* buf = &uring.buffer_ring->bufs[uring.buffer_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(uring.buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ++uring.buffer_tail;
+    __atomic_store_n(&uring.buffer_ring->tail, uring.buffer_tail, __ATOMIC_RELEASE);
+    uring.buffers_recycled = 1;
+}
+
+enum result uring_init() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_QUEUE_DEPTH * 4;
+
+    uring.fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+    if (uring.fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_QUEUE_DEPTH * 4;
+        uring.fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+    }
+    if (uring.fd < 0) {
+        uring.fd = -1;
+        log_errno("io_uring_setup failed");
+        return RESULT_ERR;
+    }
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        log_warn("io_uring lacks NODROP or EXT_ARG support");
+        uring_cleanup();
+        return RESULT_ERR;
+    }
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size) {
+            uring.sq_ring_size = uring.cq_ring_size;
+        }
+        uring.cq_ring_size = uring.sq_ring_size;
+    }
+
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED) {
+        uring.sq_ring = NULL;
+        log_errno("mmap io_uring submission ring failed");
+        uring_cleanup();
+        return RESULT_ERR;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ring == MAP_FAILED) {
+            uring.cq_ring = NULL;
+            log_errno("mmap io_uring completion ring failed");
+            uring_cleanup();
+            return RESULT_ERR;
+        }
+    }
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        log_errno("mmap io_uring submission entries failed");
+        uring_cleanup();
+        return RESULT_ERR;
+    }
+
+    char* sq_ring = uring.sq_ring;
+    char* cq_ring = uring.cq_ring;
+    uring.sq_head = (unsigned*)(sq_ring + params.sq_off.head);
+    uring.sq_tail = (unsigned*)(sq_ring + params.sq_off.tail);
+    uring.sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+    uring.sq_mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+    uring.sq_entries = params.sq_entries;
+    uring.sq_local_tail = *uring.sq_tail;
+    uring.cq_head = (unsigned*)(cq_ring + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(cq_ring + params.cq_off.tail);
+    uring.cq_mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+
+    uring.buffer_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring.buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (uring.buffer_ring == MAP_FAILED || uring.buffers == NULL) {
+        if (uring.buffer_ring == MAP_FAILED) {
+            uring.buffer_ring = NULL;
+        }
+        log_error("Out of memory while allocating io_uring buffers");
+        uring_cleanup();
+        return RESULT_ERR;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring.buffer_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_errno("io_uring buffer ring registration failed");
+        uring_cleanup();
+        return RESULT_ERR;
+    }
+
+    uring.buffer_tail = 0;
+    for (int bid = 0; bid < URING_BUFFER_COUNT; ++bid) {
+        uring_recycle_buffer(bid);
+    }
+    uring.buffers_recycled = 0;
+    uring.starved = NULL;
+    return RESULT_OK;
+}
+
+int uring_enter(unsigned wait_count, int timeout_ms) {
+    unsigned to_submit = uring.sq_local_tail - *uring.sq_tail;
+    __atomic_store_n(uring.sq_tail, uring.sq_local_tail, __ATOMIC_RELEASE);
+
+    if (wait_count == 0) {
+        return syscall(__NR_io_uring_enter, uring.fd, to_submit, 0, 0, NULL, 0);
+    }
+
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+    }
+    return syscall(__NR_io_uring_enter, uring.fd, to_submit, wait_count,
+                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_sqe* uring_get_sqe() {
+    if (uring.sq_local_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries) {
+        uring_enter(0, 0);
+    }
+    unsigned index = uring.sq_local_tail & uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index] = index;
+    ++uring.sq_local_tail;
+    return sqe;
+}
+
+void uring_prep_accept(struct worker* worker) {
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    worker->accept_multishot = config.overload != OVERLOAD_PAUSE || connection_limit - connection_active_count > ACCEPT_BATCH_SIZE;
+    sqe->fd = worker->listen_fd;
+    sqe->ioprio = worker->accept_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_user_data(worker, URING_OP_ACCEPT);
+    worker->accept_armed = 1;
+}
+
+void uring_prep_wake(struct worker* worker) {
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handoff_wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_user_data(worker, URING_OP_WAKE);
+}
+
+void uring_prep_cancel_accept(struct worker* worker) {
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(worker, URING_OP_ACCEPT);
+    sqe->user_data = uring_user_data(worker, URING_OP_CANCEL_ACCEPT);
+}
+
+void uring_prep_recv(struct connection* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->client_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = uring_user_data(conn, URING_OP_RECV);
+    conn->uring_flags |= URING_RECV_ARMED;
+    ++conn->uring_pending;
+}
+
+void uring_prep_cancel_recv(struct connection* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_user_data(conn, URING_OP_RECV);
+    sqe->user_data = uring_user_data(conn, URING_OP_CANCEL);
+    conn->uring_flags |= URING_RECV_CANCELING;
+    ++conn->uring_pending;
+}
+
+void uring_prep_poll_out(struct connection* conn) {
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->client_fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = uring_user_data(conn, URING_OP_POLL);
+    ++conn->uring_pending;
+}
+
+void uring_release_buffers(struct connection* conn) {
+    while (conn->uring_held_head != URING_NO_BUFFER) {
+        uint16_t bid = conn->uring_held_head;
+        conn->uring_held_head = uring.buffer_next[bid];
+        uring_recycle_buffer(bid);
+    }
+    conn->uring_held_tail = URING_NO_BUFFER;
+    conn->uring_held_offset = 0;
+    conn->uring_held_count = 0;
+}
+
+void uring_close_connection(struct connection* conn) {
+    if (!(conn->uring_flags & URING_CLOSING)) {
+        conn->uring_flags |= URING_CLOSING;
+        timer_remove(conn);
+        discard_unread_input(conn);
+        shutdown(conn->client_fd, SHUT_RDWR);
+        if ((conn->uring_flags & URING_RECV_ARMED) && !(conn->uring_flags & URING_RECV_CANCELING)) {
+            uring_prep_cancel_recv(conn);
+        }
+    }
+    if (conn->uring_pending > 0) {
+        return;
+    }
+
+    uring_release_buffers(conn);
+    if (conn->uring_flags & URING_STARVED) {
+        struct connection** ptr = &uring.starved;
+        while (*ptr != conn) {
+            ptr = &(*ptr)->uring_starved_next;
+        }
+        *ptr = conn->uring_starved_next;
+    }
+    release_connection(conn);
+}
+#endif
+
+void close_connection(struct connection* conn) {
+    if (conn) {
+        log_debug("Closing connection for fd %d", conn->client_fd);
+#ifdef WITH_IO_URING
+        if (uring.fd != -1) {
+            uring_close_connection(conn);
+            return;
+        }
+#endif
+        discard_unread_input(conn);
+        release_connection(conn);
+    }
+}
+
+void assign_worker_cpus() {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[cpu_count++] = cpu;
+            }
+        }
+    }
+    if (cpu_count == 0) {
+        log_warn("Cannot read the CPU set, workers stay unpinned");
+        config.cpu_affinity = 0;
+        return;
+    }
+    for (int i = 0; i < config.worker_count; ++i) {
+        workers[i].cpu = cpus[i % cpu_count];
+    }
+}
+
+void steer_listeners() {
+    struct sock_filter program[2 * MAX_WORKERS + 2];
+    int length = 0;
+    int shared = 0;
+
+    program[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < config.worker_count; ++i) {
+        if (setsockopt(workers[i].listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu, sizeof(workers[i].cpu)) < 0) {
+            log_warn("setsockopt(SO_INCOMING_CPU) failed: %s", strerror(errno));
+        }
+        for (int j = 0; j < i; ++j) {
+            shared |= workers[j].cpu == workers[i].cpu;
+        }
+        program[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1);
+        program[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    program[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+    if (shared) {
+        log_warn("Workers share CPUs, connections stay hashed across workers");
+        return;
+    }
+
+    struct sock_fprog filter = {(unsigned short)length, program};
+    if (setsockopt(workers[0].listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &filter, sizeof(filter)) < 0) {
+        log_warn("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed: %s", strerror(errno));
+        return;
+    }
+    log_info("Connections steered to the worker on the receiving CPU");
+}
+
+enum result setup_server_socket(int* listen_fd) {
+    struct sockaddr_in server_addr;
+
+    *listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (*listen_fd < 0) {
+        log_errno("socket failed");
+        return RESULT_ERR;
+    }
+
+    int opt = 1;
+    if (setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        log_errno("setsockopt(SO_REUSEADDR) failed");
+        close(*listen_fd);
+        return RESULT_ERR;
+    }
+    if (setsockopt(*listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        log_errno("setsockopt(SO_REUSEPORT) failed");
+        close(*listen_fd);
+        return RESULT_ERR;
+    }
+    int defer_timeout = config.keepalive_timeout;
+    if (setsockopt(*listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_timeout, sizeof(defer_timeout)) < 0) {
+        log_errno("setsockopt(TCP_DEFER_ACCEPT) failed");
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(PORT);
+
+    if (bind(*listen_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        log_errno("bind failed");
+        close(*listen_fd);
+        return RESULT_ERR;
+    }
+
+    if (listen(*listen_fd, config.backlog) < 0) {
+        log_errno("listen failed");
+        close(*listen_fd);
+        return RESULT_ERR;
+    }
+
+    return RESULT_OK;
+}
+
+static const unsigned char token_chars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+    ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+size_t scan_token(const char* data, size_t len) {
+    size_t i = 0;
+    while (i < len && token_chars[(unsigned char)data[i]]) {
+        ++i;
+    }
+    return i;
+}
+
+size_t scan_target_scalar(const char* data, size_t len) {
+    size_t i = 0;
+    while (i < len && (unsigned char)data[i] > ' ' && data[i] != 0x7f) {
+        ++i;
+    }
+    return i;
+}
+
+size_t scan_field_scalar(const char* data, size_t len) {
+    size_t i = 0;
+    while (i < len && ((unsigned char)data[i] >= ' ' || data[i] == '\t') && data[i] != 0x7f) {
+        ++i;
+    }
+    return i;
+}
+
+int contains_dotdot_scalar(const char* data, size_t len) {
+    for (size_t i = 1; i < len; ++i) {
+        if (data[i] == '.' && data[i - 1] == '.') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef SIMD_SSE2
+size_t scan_target_sse2(const char* data, size_t len) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, space), _mm_setzero_si128()),
+                                    _mm_cmpeq_epi8(v, del));
+        int mask = _mm_movemask_epi8(stop);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_target_scalar(data + i, len - i);
+}
+
+size_t scan_field_sse2(const char* data, size_t len) {
+    const __m128i below_space = _mm_set1_epi8(' ' - 1);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i control = _mm_andnot_si128(_mm_cmpeq_epi8(v, tab),
+                                           _mm_cmpeq_epi8(_mm_subs_epu8(v, below_space), _mm_setzero_si128()));
+        int mask = _mm_movemask_epi8(_mm_or_si128(control, _mm_cmpeq_epi8(v, del)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_field_scalar(data + i, len - i);
+}
+
+int contains_dotdot_sse2(const char* data, size_t len) {
+    const __m128i dot = _mm_set1_epi8('.');
+    size_t i = 0;
+
+    for (; i + 17 <= len; i += 16) {
+        __m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), dot);
+        __m128i second = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 1)), dot);
+        if (_mm_movemask_epi8(_mm_and_si128(first, second)) != 0) {
+            return 1;
+        }
+    }
+    return contains_dotdot_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) size_t scan_target_avx2(const char* data, size_t len) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(v, space), _mm256_setzero_si256()),
+                                       _mm256_cmpeq_epi8(v, del));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(stop);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    _mm256_zeroupper();
+    return i + scan_target_sse2(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) size_t scan_field_avx2(const char* data, size_t len) {
+    const __m256i below_space = _mm256_set1_epi8(' ' - 1);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i control = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab),
+                                              _mm256_cmpeq_epi8(_mm256_subs_epu8(v, below_space), _mm256_setzero_si256()));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(control, _mm256_cmpeq_epi8(v, del)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    _mm256_zeroupper();
+    return i + scan_field_sse2(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) int contains_dotdot_avx2(const char* data, size_t len) {
+    const __m256i dot = _mm256_set1_epi8('.');
+    size_t i = 0;
+
+    for (; i + 33 <= len; i += 32) {
+        __m256i first = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i)), dot);
+        __m256i second = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(data + i + 1)), dot);
+        if (_mm256_movemask_epi8(_mm256_and_si256(first, second)) != 0) {
+            return 1;
+        }
+    }
+    _mm256_zeroupper();
+    return contains_dotdot_sse2(data + i, len - i);
+}
+#endif
+
+#ifdef SIMD_NEON
+static inline uint64_t neon_mask(uint8x16_t matches) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+}
+
+size_t scan_target_neon(const char* data, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)data + i);
+        uint64_t mask = neon_mask(vorrq_u8(vcleq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8(0x7f))));
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return i + scan_target_scalar(data + i, len - i);
+}
+
+size_t scan_field_neon(const char* data, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)data + i);
+        uint8x16_t control = vbicq_u8(vcltq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t')));
+        uint64_t mask = neon_mask(vorrq_u8(control, vceqq_u8(v, vdupq_n_u8(0x7f))));
+        if (mask != 0) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return i + scan_field_scalar(data + i, len - i);
+}
+
+int contains_dotdot_neon(const char* data, size_t len) {
+    size_t i = 0;
+
+    for (; i + 17 <= len; i += 16) {
+        uint8x16_t first = vceqq_u8(vld1q_u8((const uint8_t*)data + i), vdupq_n_u8('.'));
+        uint8x16_t second = vceqq_u8(vld1q_u8((const uint8_t*)data + i + 1), vdupq_n_u8('.'));
+        if (neon_mask(vandq_u8(first, second)) != 0) {
+            return 1;
+        }
+    }
+    return contains_dotdot_scalar(data + i, len - i);
+}
+#endif
+
+size_t (*scan_target)(const char* data, size_t len) = scan_target_scalar;
+size_t (*scan_field)(const char* data, size_t len) = scan_field_scalar;
+int (*contains_dotdot)(const char* data, size_t len) = contains_dotdot_scalar;
+
+const char* simd_init() {
+#if defined(SIMD_SSE2)
+    if (__builtin_cpu_supports("avx2")) {
+        scan_target = scan_target_avx2;
+        scan_field = scan_field_avx2;
+        contains_dotdot = contains_dotdot_avx2;
+        return "avx2";
+    }
+    scan_target = scan_target_sse2;
+    scan_field = scan_field_sse2;
+    contains_dotdot = contains_dotdot_sse2;
+    return "sse2";
+#elif defined(SIMD_NEON)
+    scan_target = scan_target_neon;
+    scan_field = scan_field_neon;
+    contains_dotdot = contains_dotdot_neon;
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+struct string_view make_view(size_t start, size_t end) {
+    struct string_view view = {(uint16_t)start, (uint16_t)(end - start)};
+    return view;
+}
+
+struct string_view trim_view(const char* buffer, size_t start, size_t end) {
+    while (start < end && (buffer[start] == ' ' || buffer[start] == '\t')) {
+        ++start;
+    }
+    while (end > start && (buffer[end - 1] == ' ' || buffer[end - 1] == '\t')) {
+        --end;
+    }
+    return make_view(start, end);
+}
+
+void http_request_reset(struct http_request* req) {
+    req->state = PARSE_METHOD;
+    req->offset = 0;
+    req->token_start = 0;
+    req->method.length = 0;
+    req->path.length = 0;
+    req->header_count = 0;
+    req->content_length = -1;
+}
+
+enum result parse_framing_header(struct http_request* req, const char* buffer, const struct http_header* header) {
+    const char* name = buffer + header->name.offset;
+
+    if (header->name.length == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0) {
+        return RESULT_ERR;
+    }
+    if (header->name.length != 14 || strncasecmp(name, "Content-Length", 14) != 0) {
+        return RESULT_OK;
+    }
+
+    const char* p = buffer + header->value.offset;
+    const char* end = p + header->value.length;
+    ssize_t length = 0;
+    if (p == end) {
+        return RESULT_ERR;
+    }
+    for (; p < end; ++p) {
+        if (*p < '0' || *p > '9' || length > (SSIZE_MAX - 9) / 10) {
+            return RESULT_ERR;
+        }
+        length = length * 10 + (*p - '0');
+    }
+    if (req->content_length != -1 && req->content_length != length) {
+        return RESULT_ERR;
+    }
+    req->content_length = length;
+    return RESULT_OK;
+}
+
+enum result parse_http_request(struct http_request* req, const char* buffer, size_t len) {
+    while (req->offset < len) {
+        const char* p = buffer + req->offset;
+        size_t remaining = len - req->offset;
+        size_t n;
+
+        switch (req->state) {
+            case PARSE_METHOD:
+                if (req->offset == req->token_start && (*p == '\r' || *p == '\n')) {
+                    req->token_start = ++req->offset;
+                    break;
+                }
+                n = scan_token(p, remaining);
+                req->offset += n;
+                if (n == remaining) {
+                    return RESULT_ERR_AGAIN;
+                }
+                if (buffer[req->offset] != ' ' || req->offset == req->token_start) {
+                    return RESULT_ERR;
+                }
+                req->method = make_view(req->token_start, req->offset);
+                req->token_start = ++req->offset;
+                req->state = PARSE_TARGET;
+                break;
+
+            case PARSE_TARGET:
+                n = scan_target(p, remaining);
+                req->offset += n;
+                if (n == remaining) {
+                    return RESULT_ERR_AGAIN;
+                }
+                if (buffer[req->offset] != ' ' || req->offset == req->token_start) {
+                    return RESULT_ERR;
+                }
+                {
+                    const char* query = memchr(buffer + req->token_start, '?', req->offset - req->token_start);
+                    size_t path_end = query != NULL ? (size_t)(query - buffer) : req->offset;
+                    req->path = make_view(req->token_start, path_end);
+                    req->query = query != NULL ? make_view(path_end + 1, req->offset) : make_view(req->offset, req->offset);
+                }
+                req->token_start = ++req->offset;
+                req->state = PARSE_VERSION;
+                break;
+
+            case PARSE_VERSION:
+                n = scan_field(p, remaining);
+                req->offset += n;
+                if (n == remaining) {
+                    return RESULT_ERR_AGAIN;
+                }
+                {
+                    const char* version = buffer + req->token_start;
+                    if (req->offset - req->token_start != 8 || memcmp(version, "HTTP/1.", 7) != 0 ||
+                        version[7] < '0' || version[7] > '9') {
+                        return RESULT_ERR;
+                    }
+                    req->version = make_view(req->token_start, req->offset);
+                    req->version_minor = version[7] - '0';
+                }
+                if (buffer[req->offset] == '\r') {
+                    req->state = PARSE_LINE_END;
+                } else if (buffer[req->offset] == '\n') {
+                    req->state = PARSE_HEADER_NAME;
+                } else {
+                    return RESULT_ERR;
+                }
+                req->token_start = ++req->offset;
+                break;
+
+            case PARSE_LINE_END:
+                if (*p != '\n') {
+                    return RESULT_ERR;
+                }
+                req->token_start = ++req->offset;
+                req->state = PARSE_HEADER_NAME;
+                break;
+
+            case PARSE_HEADER_NAME:
+                if (req->offset == req->token_start) {
+                    if (*p == '\r') {
+                        ++req->offset;
+                        req->state = PARSE_HEADERS_END;
+                        break;
+                    }
+                    if (*p == '\n') {
+                        req->token_start = ++req->offset;
+                        req->state = req->content_length > 0 ? PARSE_BODY : PARSE_DONE;
+                        break;
+                    }
+                }
+                n = scan_token(p, remaining);
+                req->offset += n;
+                if (n == remaining) {
+                    return RESULT_ERR_AGAIN;
+                }
+                if (buffer[req->offset] != ':' || req->offset == req->token_start) {
+                    return RESULT_ERR;
+                }
+                if (req->header_count == MAX_HEADERS) {
+                    req->state = PARSE_TOO_MANY_HEADERS;
+                    return RESULT_ERR;
+                }
+                req->headers[req->header_count].name = make_view(req->token_start, req->offset);
+                req->token_start = ++req->offset;
+                req->state = PARSE_HEADER_VALUE;
+                break;
+
+            case PARSE_HEADER_VALUE:
+                n = scan_field(p, remaining);
+                req->offset += n;
+                if (n == remaining) {
+                    return RESULT_ERR_AGAIN;
+                }
+                req->headers[req->header_count].value = trim_view(buffer, req->token_start, req->offset);
+                if (parse_framing_header(req, buffer, &req->headers[req->header_count++]) != RESULT_OK) {
+                    return RESULT_ERR;
+                }
+                if (buffer[req->offset] == '\r') {
+                    req->state = PARSE_LINE_END;
+                } else if (buffer[req->offset] == '\n') {
+                    req->state = PARSE_HEADER_NAME;
+                } else {
+                    return RESULT_ERR;
+                }
+                req->token_start = ++req->offset;
+                break;
+
+            case PARSE_HEADERS_END:
+                if (*p != '\n') {
+                    return RESULT_ERR;
+                }
+                req->token_start = ++req->offset;
+                req->state = req->content_length > 0 ? PARSE_BODY : PARSE_DONE;
+                break;
+
+            case PARSE_BODY:
+                if ((size_t)req->content_length > len - req->token_start) {
+                    req->offset = len;
+                    return RESULT_ERR_AGAIN;
+                }
+                req->offset = req->token_start + req->content_length;
+                req->state = PARSE_DONE;
+                return RESULT_OK;
+
+            case PARSE_DONE:
+                return RESULT_OK;
+            case PARSE_TOO_MANY_HEADERS:
+                return RESULT_ERR;
+        }
+    }
+    return req->state == PARSE_DONE ? RESULT_OK : RESULT_ERR_AGAIN;
+}
+
+int view_equals(const char* buffer, struct string_view view, const char* literal) {
+    return view.length == strlen(literal) && memcmp(buffer + view.offset, literal, view.length) == 0;
+}
+
+const struct http_header* find_header(const struct connection* conn, const char* name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < conn->buffer->request.header_count; ++i) {
+        const struct http_header* header = &conn->buffer->request.headers[i];
+        if (header->name.length == name_len &&
+            strncasecmp(conn->buffer->request_buffer + header->name.offset, name, name_len) == 0) {
+            return header;
+        }
+    }
+    return NULL;
+}
+
+int header_has_token(const char* buffer, struct string_view value, const char* token) {
+    size_t token_len = strlen(token);
+    const char* p = buffer + value.offset;
+    const char* end = p + value.length;
+
+    while (p < end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* item_end = comma != NULL ? comma : end;
+        struct string_view item = trim_view(buffer, p - buffer, item_end - buffer);
+        if (item.length == token_len && strncasecmp(buffer + item.offset, token, token_len) == 0) {
+            return 1;
+        }
+        p = item_end + 1;
+    }
+    return 0;
+}
+
+int parse_qvalue(const char* p, const char* end) {
+    while (p < end) {
+        const char* semicolon = memchr(p, ';', end - p);
+        if (semicolon == NULL) {
+            break;
+        }
+        p = semicolon + 1;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            ++p;
+        }
+        if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+            p += 2;
+            if (p < end && *p == '1') {
+                return 1000;
+            }
+            int qvalue = 0;
+            int scale = 1000;
+            if (p < end && *p == '0' && ++p < end && *p == '.') {
+                for (++p; p < end && *p >= '0' && *p <= '9' && scale > 1; ++p) {
+                    scale /= 10;
+                    qvalue += (*p - '0') * scale;
+                }
+            }
+            return qvalue;
+        }
+    }
+    return 1000;
+}
+
+void parse_accept_encoding(const char* buffer, struct string_view value, int qvalues[ENCODING_COUNT]) {
+    const char* p = buffer + value.offset;
+    const char* end = p + value.length;
+    int wildcard = -1;
+    int explicit_mask = 0;
+
+    qvalues[ENCODING_IDENTITY] = 1;
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; ++encoding) {
+        qvalues[encoding] = 0;
+    }
+
+    while (p < end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* item_end = comma != NULL ? comma : end;
+        const char* name_end = memchr(p, ';', item_end - p);
+        struct string_view name = trim_view(buffer, p - buffer, (name_end != NULL ? name_end : item_end) - buffer);
+        int qvalue = parse_qvalue(p, item_end);
+
+        if (view_equals(buffer, name, "*")) {
+            wildcard = qvalue;
+        } else if (view_equals(buffer, name, "x-gzip")) {
+            qvalues[ENCODING_GZIP] = qvalue;
+            explicit_mask |= 1 << ENCODING_GZIP;
+        } else {
+            for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+                if (name.length == strlen(encoding_names[encoding]) &&
+                    strncasecmp(buffer + name.offset, encoding_names[encoding], name.length) == 0) {
+                    qvalues[encoding] = qvalue;
+                    explicit_mask |= 1 << encoding;
+                }
+            }
+        }
+        p = item_end + 1;
+    }
+
+    if (wildcard >= 0) {
+        for (int encoding = 0; encoding < ENCODING_COUNT; ++encoding) {
+            if (!(explicit_mask & (1 << encoding))) {
+                qvalues[encoding] = wildcard;
+            }
+        }
+    }
+}
+
+const struct cached_response* select_variant(const struct connection* conn, const struct cache_entry* entry) {
+    const struct http_header* accept_encoding = find_header(conn, "Accept-Encoding");
+    const struct cached_response* best = &entry->variants[ENCODING_IDENTITY];
+    if (accept_encoding == NULL) {
+        return best;
+    }
+
+    int qvalues[ENCODING_COUNT];
+    parse_accept_encoding(conn->buffer->request_buffer, accept_encoding->value, qvalues);
+
+    int best_qvalue = qvalues[ENCODING_IDENTITY];
+    for (int encoding = ENCODING_IDENTITY + 1; encoding < ENCODING_COUNT; ++encoding) {
+        const struct cached_response* variant = &entry->variants[encoding];
+        if (variant->data == NULL || qvalues[encoding] == 0) {
+            continue;
+        }
+        if (qvalues[encoding] > best_qvalue || (qvalues[encoding] == best_qvalue && variant->length < best->length)) {
+            best = variant;
+            best_qvalue = qvalues[encoding];
+        }
+    }
+    return best;
+}
+
+int etag_list_matches(const char* buffer, struct string_view value, const char* etag) {
+    size_t etag_len = strlen(etag);
+    const char* p = buffer + value.offset;
+    const char* end = p + value.length;
+
+    while (p < end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* item_end = comma != NULL ? comma : end;
+        struct string_view item = trim_view(buffer, p - buffer, item_end - buffer);
+        const char* tag = buffer + item.offset;
+
+        if (item.length == 1 && tag[0] == '*') {
+            return 1;
+        }
+        if (item.length > 2 && tag[0] == 'W' && tag[1] == '/') {
+            tag += 2;
+            item.length -= 2;
+        }
+        if (item.length == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+        p = item_end + 1;
+    }
+    return 0;
+}
+
+int parse_http_date(const char* buffer, struct string_view value, time_t* time) {
+    if (value.length >= HTTP_DATE_MAX_LEN) {
+        return 0;
+    }
+    char date[HTTP_DATE_MAX_LEN];
+    struct tm tm;
+    memcpy(date, buffer + value.offset, value.length);
+    date[value.length] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    const char* date_end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (date_end == NULL || *date_end != '\0') {
+        return 0;
+    }
+    *time = timegm(&tm);
+    return 1;
+}
+
+int is_not_modified(const struct connection* conn, const char* etag, time_t last_modified) {
+    const struct http_header* if_none_match = find_header(conn, "If-None-Match");
+    if (if_none_match != NULL) {
+        return etag_list_matches(conn->buffer->request_buffer, if_none_match->value, etag);
+    }
+
+    const struct http_header* if_modified_since = find_header(conn, "If-Modified-Since");
+    time_t since;
+    return if_modified_since != NULL && parse_http_date(conn->buffer->request_buffer, if_modified_since->value, &since) &&
+           last_modified <= since;
+}
+
+int if_range_matches(const struct connection* conn, const char* etag, time_t last_modified) {
+    const struct http_header* if_range = find_header(conn, "If-Range");
+    if (if_range == NULL) {
+        return 1;
+    }
+    const char* buffer = conn->buffer->request_buffer;
+    if (if_range->value.length > 0 && buffer[if_range->value.offset] == '"') {
+        return if_range->value.length == strlen(etag) && memcmp(buffer + if_range->value.offset, etag, if_range->value.length) == 0;
+    }
+    time_t date;
+    return parse_http_date(buffer, if_range->value, &date) && date == last_modified;
+}
+
+const char* parse_range_offset(const char* p, const char* end, off_t* value) {
+    const char* start = p;
+    *value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (*value > (INT64_MAX - 9) / 10) {
+            return NULL;
+        }
+        *value = *value * 10 + (*p - '0');
+        ++p;
+    }
+    return p > start ? p : NULL;
+}
+
+enum range_result parse_range(const struct connection* conn, const char* etag, time_t last_modified, off_t size,
+                              off_t* offset, off_t* length) {
+    const struct http_header* range = find_header(conn, "Range");
+    if (range == NULL || !if_range_matches(conn, etag, last_modified)) {
+        return RANGE_NONE;
+    }
+
+    const char* p = conn->buffer->request_buffer + range->value.offset;
+    const char* end = p + range->value.length;
+    if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0 || memchr(p, ',', end - p) != NULL) {
+        return RANGE_NONE;
+    }
+    p += 6;
+
+    off_t first = -1;
+    off_t last = -1;
+    if (p < end && *p != '-' && (p = parse_range_offset(p, end, &first)) == NULL) {
+        return RANGE_NONE;
+    }
+    if (p == end || *p++ != '-') {
+        return RANGE_NONE;
+    }
+    if (p < end && (p = parse_range_offset(p, end, &last)) == NULL) {
+        return RANGE_NONE;
+    }
+    if (p != end || (first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first)) {
+        return RANGE_NONE;
+    }
+
+    if (first < 0) {
+        if (last == 0 || size == 0) {
+            return RANGE_NOT_SATISFIABLE;
+        }
+        first = last < size ? size - last : 0;
+        last = size - 1;
+    }
+    if (first >= size) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    if (last < 0 || last >= size) {
+        last = size - 1;
+    }
+    *offset = first;
+    *length = last - first + 1;
+    return RANGE_SATISFIABLE;
+}
+
+enum result parse_request(struct connection* conn) {
+    const struct http_request* req = &conn->buffer->request;
+    const char* buffer = conn->buffer->request_buffer;
+
+    const struct http_header* connection_header = find_header(conn, "Connection");
+    conn->keep_alive = req->version_minor == 1 &&
+                       (connection_header == NULL || !header_has_token(buffer, connection_header->value, "close")) &&
+                       conn->requests_served + 1 < config.max_requests &&
+                       !atomic_load_explicit(&server_draining, memory_order_relaxed);
+
+    if (view_equals(buffer, req->method, "GET")) {
+        conn->method = METHOD_GET;
+    } else {
+        conn->method = METHOD_UNKNOWN;
+        conn->status_code = STATUS_METHOD_NOT_ALLOWED;
+        return RESULT_ERR;
+    }
+
+    if (contains_dotdot(buffer + req->path.offset, req->path.length)) {
+        log_debug("Directory traversal attempt detected: %.*s", VIEW_ARGS(buffer, req->path));
+        counter_add(&current_worker->metrics.traversal_rejects, 1);
+        conn->status_code = STATUS_BAD_REQUEST;
+        return RESULT_ERR;
+    }
+
+    log_debug("Parsed Request: Method=GET, URI=%.*s", VIEW_ARGS(buffer, req->path));
+    return RESULT_OK;
+}
+
+enum result prepare_error_response(struct connection* conn) {
+    if (conn->status_code != STATUS_NOT_FOUND) {
+        conn->keep_alive = 0;
+    }
+
+    struct response_cache* cache = atomic_load_explicit(&response_cache_current, memory_order_acquire);
+    int index = error_response_index(conn->status_code);
+    if (cache == NULL || index < 0) {
+        log_error("No error response for status %d", conn->status_code);
+        return RESULT_ERR;
+    }
+    cache_pin(cache);
+    conn->cache = cache;
+    conn->cached_response = &cache->errors[index];
+    conn->file_end = 0;
+    conn->bytes_sent = 0;
+
+    log_debug("Prepared error response: %d %s", conn->status_code, get_status_message(conn->status_code));
+    return RESULT_OK;
+}
+
+enum result prepare_range_not_satisfiable(struct connection* conn, off_t size) {
+    conn->status_code = STATUS_RANGE_NOT_SATISFIABLE;
+    conn->file_offset = 0;
+    conn->file_end = 0;
+    conn->bytes_sent = 0;
+    conn->response_header_len = snprintf(conn->buffer->response_header_buffer, RESPONSE_BUFFER_SIZE,
+                                         "HTTP/1.1 %d %s\r\n"
+                                         "Content-Range: bytes */%lld\r\n"
+                                         "Content-Length: 0\r\n"
+                                         "%s\r\n",
+                                         conn->status_code, get_status_message(conn->status_code), (long long)size,
+                                         conn->keep_alive ? "" : "Connection: close\r\n");
+    return RESULT_OK;
+}
+
+enum result prepare_partial_cached_response(struct connection* conn, off_t offset, off_t length) {
+    const struct cached_response* response = conn->cached_response;
+    const char* header = response->data;
+    const char* header_end = header + response->header_len - 2;
+    const char* length_line = memmem(header, response->header_len, "\r\nContent-Length: ", 18);
+    const char* status_end = memchr(header, '\n', response->header_len);
+    const char* rest = length_line != NULL ? memchr(length_line + 2, '\n', header_end - length_line - 2) : NULL;
+    if (status_end == NULL || rest == NULL) {
+        return RESULT_ERR;
+    }
+    ++status_end;
+    ++rest;
+
+    int len = snprintf(conn->buffer->response_header_buffer, RESPONSE_BUFFER_SIZE,
+                       "HTTP/1.1 %d %s\r\n"
+                       "%.*s"
+                       "Content-Length: %lld\r\n"
+                       "Content-Range: bytes %lld-%lld/%zu\r\n"
+                       "%.*s"
+                       "%s\r\n",
+                       STATUS_PARTIAL_CONTENT, get_status_message(STATUS_PARTIAL_CONTENT),
+                       (int)(length_line + 2 - status_end), status_end,
+                       (long long)length, (long long)offset, (long long)(offset + length - 1), response->length - response->header_len,
+                       (int)(header_end - rest), rest,
+                       conn->keep_alive ? "" : "Connection: close\r\n");
+    if (len < 0 || len >= RESPONSE_BUFFER_SIZE) {
+        return RESULT_ERR;
+    }
+    conn->response_header_len = len;
+    conn->range_offset = offset;
+    conn->range_len = length;
+    conn->status_code = STATUS_PARTIAL_CONTENT;
+    return RESULT_OK;
+}
+
+enum result prepare_success_response(struct connection* conn, const struct cache_entry* entry) {
+    const char* file_path = entry->file_path;
+    struct stat file_stat;
+
+    conn->file_fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (conn->file_fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            log_debug("No page for %s", file_path);
+            conn->status_code = STATUS_NOT_FOUND;
+        } else {
+            log_errno("open failed");
+            conn->status_code = STATUS_INTERNAL_SERVER_ERROR;
+        }
+        return prepare_error_response(conn);
+    }
+
+    if (fstat(conn->file_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        log_debug("Path is not a regular file: %s", file_path);
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        conn->status_code = STATUS_NOT_FOUND;
+        return prepare_error_response(conn);
+    }
+
+    conn->file_end = file_stat.st_size;
+    conn->file_offset = 0;
+
+    char etag[ETAG_MAX_LEN];
+    char last_modified[HTTP_DATE_MAX_LEN];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"", (unsigned long)file_stat.st_ino,
+             (unsigned long)file_stat.st_size, (unsigned long)file_stat.st_mtim.tv_sec * 1000000000UL + file_stat.st_mtim.tv_nsec);
+    format_http_date(file_stat.st_mtime, last_modified, sizeof(last_modified));
+    char cache_control[CACHE_POLICY_MAX_LEN + 32] = "";
+    if (entry->cache_control != NULL) {
+        snprintf(cache_control, sizeof(cache_control), "Cache-Control: %s\r\n", entry->cache_control);
+    }
+
+    off_t range_offset = 0;
+    off_t range_len = file_stat.st_size;
+    enum range_result range = RANGE_NONE;
+    int not_modified = is_not_modified(conn, etag, file_stat.st_mtime);
+    int len;
+    if (!not_modified) {
+        range = parse_range(conn, etag, file_stat.st_mtime, file_stat.st_size, &range_offset, &range_len);
+    }
+    if (range == RANGE_NOT_SATISFIABLE) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        return prepare_range_not_satisfiable(conn, file_stat.st_size);
+    }
+    if (range == RANGE_SATISFIABLE) {
+        conn->file_offset = range_offset;
+        conn->file_end = range_offset + range_len;
+        conn->status_code = STATUS_PARTIAL_CONTENT;
+        len = snprintf(conn->buffer->response_header_buffer, RESPONSE_BUFFER_SIZE,
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %lld\r\n"
+                       "Content-Range: bytes %lld-%lld/%lld\r\n"
+                       "ETag: %s\r\n"
+                       "Last-Modified: %s\r\n"
+                       "%s"
+                       "%s\r\n",
+                       conn->status_code, get_status_message(conn->status_code), entry->mime_type->content_type,
+                       (long long)range_len, (long long)range_offset, (long long)(conn->file_end - 1), (long long)file_stat.st_size,
+                       etag, last_modified, cache_control,
+                       conn->keep_alive ? "" : "Connection: close\r\n");
+    } else if (not_modified) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        conn->file_end = 0;
+        conn->status_code = STATUS_NOT_MODIFIED;
+        len = snprintf(conn->buffer->response_header_buffer, RESPONSE_BUFFER_SIZE,
+                       "HTTP/1.1 %d %s\r\n"
+                       "ETag: %s\r\n"
+                       "Last-Modified: %s\r\n"
+                       "%s"
+                       "%s\r\n",
+                       conn->status_code, get_status_message(conn->status_code),
+                       etag, last_modified, cache_control,
+                       conn->keep_alive ? "" : "Connection: close\r\n");
+    } else {
+        conn->status_code = STATUS_OK;
+        len = snprintf(conn->buffer->response_header_buffer, RESPONSE_BUFFER_SIZE,
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %lld\r\n"
+                       "ETag: %s\r\n"
+                       "Last-Modified: %s\r\n"
+                       "%s"
+                       "Accept-Ranges: bytes\r\n"
+                       "%s\r\n",
+                       conn->status_code, get_status_message(conn->status_code), entry->mime_type->content_type,
+                       (long long)conn->file_end, etag, last_modified, cache_control,
+                       conn->keep_alive ? "" : "Connection: close\r\n");
+    }
+
+    if (len < 0 || len >= RESPONSE_BUFFER_SIZE) {
+        log_error("Error formatting success response header");
+        if (conn->file_fd != -1) {
+            close(conn->file_fd);
+            conn->file_fd = -1;
+        }
+        conn->file_end = 0;
+        conn->status_code = STATUS_INTERNAL_SERVER_ERROR;
+
+        return RESULT_ERR;
+    }
+    conn->response_header_len = len;
+    conn->bytes_sent = 0;
+
+    log_debug("Prepared success response for: %s (%lld bytes)", file_path, (long long)(conn->file_end - conn->file_offset));
+    return RESULT_OK;
+}
+
+size_t normalize_route_length(const char* uri, size_t uri_len) {
+    while (uri_len > 1 && uri[uri_len - 1] == '/') {
+        --uri_len;
+    }
+    return uri_len;
+}
+
+enum result prepare_cached_response(struct connection* conn) {
+    struct response_cache* cache = atomic_load_explicit(&response_cache_current, memory_order_acquire);
+    if (cache == NULL) {
+        conn->status_code = STATUS_NOT_FOUND;
+        return prepare_error_response(conn);
+    }
+
+    struct string_view path = conn->buffer->request.path;
+    const char* uri = conn->buffer->request_buffer + path.offset;
+    const struct cache_entry* entry = cache_lookup(cache, uri, normalize_route_length(uri, path.length));
+    if (entry == NULL || entry->variants[ENCODING_IDENTITY].data == NULL) {
+        counter_add(&current_worker->metrics.cache_misses, 1);
+    } else {
+        counter_add(&current_worker->metrics.cache_hits, 1);
+    }
+    if (entry != NULL && entry->variants[ENCODING_IDENTITY].data == NULL) {
+        return prepare_success_response(conn, entry);
+    }
+
+    if (entry == NULL) {
+        log_debug("No route for %.*s", VIEW_ARGS(conn->buffer->request_buffer, path));
+        conn->status_code = STATUS_NOT_FOUND;
+        return prepare_error_response(conn);
+    }
+
+    const struct cached_response* response = select_variant(conn, entry);
+    enum range_result range = RANGE_NONE;
+    off_t range_offset;
+    off_t range_len;
+    conn->status_code = STATUS_OK;
+    if (is_not_modified(conn, response->etag, entry->last_modified)) {
+        response = &entry->not_modified[response - entry->variants];
+        conn->status_code = STATUS_NOT_MODIFIED;
+    } else {
+        range = parse_range(conn, response->etag, entry->last_modified, response->length - response->header_len, &range_offset, &range_len);
+        if (range == RANGE_NOT_SATISFIABLE) {
+            return prepare_range_not_satisfiable(conn, response->length - response->header_len);
+        }
+    }
+
+    cache_pin(cache);
+    conn->cache = cache;
+    conn->cached_response = response;
+    conn->bytes_sent = 0;
+    if (range == RANGE_SATISFIABLE && prepare_partial_cached_response(conn, range_offset, range_len) != RESULT_OK) {
+        log_warn("Cannot format range header for %.*s, sending the whole page", VIEW_ARGS(conn->buffer->request_buffer, path));
+    }
+
+    log_debug("Prepared cached response for: %.*s (%zu bytes)", VIEW_ARGS(conn->buffer->request_buffer, path), conn->cached_response->length);
+    return RESULT_OK;
+}
+
+int skip_iovec(const struct iovec* iov, int iov_count, size_t skip, struct iovec* pending) {
+    int pending_count = 0;
+    for (int i = 0; i < iov_count; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        pending[pending_count].iov_base = (char*)iov[i].iov_base + skip;
+        pending[pending_count].iov_len = iov[i].iov_len - skip;
+        ++pending_count;
+        skip = 0;
+    }
+    return pending_count;
+}
+
+enum result write_iovec(int fd, const struct iovec* iov, int iov_count, long* offset) {
+    while (1) {
+        struct iovec pending[4];
+        int pending_count = skip_iovec(iov, iov_count, *offset, pending);
+        if (pending_count == 0) {
+            return RESULT_OK;
+        }
+
+        ssize_t bytes_written = writev(fd, pending, pending_count);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return RESULT_ERR_AGAIN;
+            }
+            log_debug("writev failed: %s", strerror(errno));
+            return RESULT_ERR;
+        }
+        *offset += bytes_written;
+    }
+}
+
+int cached_response_iovec(const struct connection* conn, struct iovec* iov) {
+    static const char connection_close[] = "Connection: close\r\n\r\n";
+    const struct cached_response* response = conn->cached_response;
+
+    if (conn->status_code == STATUS_PARTIAL_CONTENT) {
+        iov[0] = (struct iovec){conn->buffer->response_header_buffer, conn->response_header_len};
+        iov[1] = (struct iovec){response->data + response->header_len + conn->range_offset, conn->range_len};
+        return 2;
+    }
+    if (conn->keep_alive) {
+        iov[0] = (struct iovec){response->data, response->length};
+        return 1;
+    }
+    iov[0] = (struct iovec){response->data, response->header_len - 2};
+    iov[1] = (struct iovec){(void*)connection_close, sizeof(connection_close) - 1};
+    iov[2] = (struct iovec){response->data + response->header_len, response->length - response->header_len};
+    return 3;
+}
+
+#ifdef WITH_TLS
+ssize_t tls_read(struct connection* conn, char* data, size_t len) {
+    ERR_clear_error();
+    int bytes_read = SSL_read(conn->tls, data, len > INT_MAX ? INT_MAX : (int)len);
+    if (bytes_read > 0) {
+        conn->tls_kernel_send = BIO_get_ktls_send(SSL_get_wbio(conn->tls));
+        return bytes_read;
+    }
+    switch (SSL_get_error(conn->tls, bytes_read)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            return errno != 0 ? -1 : 0;
+        default:
+            log_debug("TLS read failed: %s", ERR_reason_error_string(ERR_peek_error()));
+            ERR_clear_error();
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+enum result tls_write(struct connection* conn, const char* data, size_t len) {
+    ERR_clear_error();
+    int bytes_written = SSL_write(conn->tls, data, len > INT_MAX ? INT_MAX : (int)len);
+    if (bytes_written > 0) {
+        conn->bytes_sent += bytes_written;
+        return RESULT_OK;
+    }
+    int error = SSL_get_error(conn->tls, bytes_written);
+    if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
+        counter_add(&current_worker->metrics.send_again, 1);
+        return RESULT_ERR_AGAIN;
+    }
+    log_debug("TLS write failed: %s", ERR_reason_error_string(ERR_peek_error()));
+    ERR_clear_error();
+    return RESULT_ERR;
+}
+
+enum result tls_send_response(struct connection* conn) {
+    while (1) {
+        enum result res;
+        if (conn->cached_response != NULL) {
+            struct iovec iov[3];
+            struct iovec pending[4];
+            if (skip_iovec(iov, cached_response_iovec(conn, iov), conn->bytes_sent, pending) == 0) {
+                return RESULT_OK;
+            }
+            res = tls_write(conn, pending[0].iov_base, pending[0].iov_len);
+        } else if (conn->bytes_sent < conn->response_header_len) {
+            res = tls_write(conn, conn->buffer->response_header_buffer + conn->bytes_sent, conn->response_header_len - conn->bytes_sent);
+        } else if (conn->file_offset < conn->file_end) {
+            char chunk[TLS_CHUNK_SIZE];
+            size_t chunk_len = conn->file_end - conn->file_offset < TLS_CHUNK_SIZE ? conn->file_end - conn->file_offset : TLS_CHUNK_SIZE;
+            ssize_t bytes_read = pread(conn->file_fd, chunk, chunk_len, conn->file_offset);
+            if (bytes_read <= 0) {
+                log_warn("File ended early at offset %lld for fd %d", (long long)conn->file_offset, conn->client_fd);
+                return RESULT_ERR;
+            }
+            long bytes_sent = conn->bytes_sent;
+            res = tls_write(conn, chunk, bytes_read);
+            conn->file_offset += conn->bytes_sent - bytes_sent;
+        } else {
+            return RESULT_OK;
+        }
+        if (res != RESULT_OK) {
+            return res;
+        }
+    }
+}
+#endif
+
+int next_request_buffered(const struct connection* conn) {
+    size_t pending = conn->request_len - conn->request_end;
+    return pending >= 4 && memmem(conn->buffer->request_buffer + conn->request_end, pending, "\r\n\r\n", 4) != NULL;
+}
+
+enum result send_cached_response(struct connection* conn) {
+    const struct cached_response* response = conn->cached_response;
+
+    if (!conn->keep_alive || conn->status_code == STATUS_PARTIAL_CONTENT) {
+        struct iovec iov[3];
+        int iov_count = cached_response_iovec(conn, iov);
+        enum result res = write_iovec(conn->client_fd, iov, iov_count, &conn->bytes_sent);
+        if (res == RESULT_ERR_AGAIN) {
+            counter_add(&current_worker->metrics.send_again, 1);
+        }
+        return res;
+    }
+
+    int flags = next_request_buffered(conn) ? MSG_MORE : 0;
+    while ((size_t)conn->bytes_sent < response->length) {
+        ssize_t bytes_written = send(conn->client_fd,
+                                     response->data + conn->bytes_sent,
+                                     response->length - conn->bytes_sent, flags);
+
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                counter_add(&current_worker->metrics.send_again, 1);
+                return RESULT_ERR_AGAIN;
+            }
+            log_debug("write cached response failed: %s", strerror(errno));
+            return RESULT_ERR;
+        }
+        conn->bytes_sent += bytes_written;
+    }
+    return RESULT_OK;
+}
+
+enum result send_response(struct connection* conn) {
+    ssize_t bytes_written;
+
+#ifdef WITH_TLS
+    if (conn->tls != NULL && !conn->tls_kernel_send) {
+        return tls_send_response(conn);
+    }
+#endif
+    if (conn->cached_response != NULL) {
+        return send_cached_response(conn);
+    }
+
+    if (conn->response_header_len == 0) {
+        log_warn("No headers to send for fd %d", conn->client_fd);
+        return RESULT_ERR;
+    }
+
+    while (conn->bytes_sent < conn->response_header_len) {
+        int flags = conn->file_offset < conn->file_end ? MSG_MORE : 0;
+        bytes_written = send(conn->client_fd,
+                             conn->buffer->response_header_buffer + conn->bytes_sent,
+                             conn->response_header_len - conn->bytes_sent, flags);
+
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                counter_add(&current_worker->metrics.send_again, 1);
+                return RESULT_ERR_AGAIN;
+            }
+            log_debug("write headers failed: %s", strerror(errno));
+            return RESULT_ERR;
+        }
+        conn->bytes_sent += bytes_written;
+    }
+
+    while (conn->file_offset < conn->file_end) {
+        bytes_written = sendfile(conn->client_fd, conn->file_fd, &conn->file_offset, conn->file_end - conn->file_offset);
+
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                counter_add(&current_worker->metrics.send_again, 1);
+                return RESULT_ERR_AGAIN;
+            }
+            log_debug("sendfile failed: %s", strerror(errno));
+            return RESULT_ERR;
+        }
+        if (bytes_written == 0) {
+            log_warn("File ended early: offset (%lld) != end (%lld) for fd %d",
+                     (long long)conn->file_offset, (long long)conn->file_end, conn->client_fd);
+            return RESULT_ERR;
+        }
+        conn->bytes_sent += bytes_written;
+    }
+
+    log_debug("Response sent for fd %d (%ld bytes)", conn->client_fd, conn->bytes_sent);
+    return RESULT_OK;
+}
+
+enum result read_request_data(struct connection* conn) {
+    size_t total_read = 0;
+    int request_started = conn->request_len == 0;
+
+    while (conn->request_len < REQUEST_BUFFER_SIZE - 1) {
+        ssize_t bytes_read;
+#ifdef WITH_TLS
+        if (conn->tls != NULL) {
+            bytes_read = tls_read(conn, conn->buffer->request_buffer + conn->request_len, REQUEST_BUFFER_SIZE - 1 - conn->request_len);
+        } else
+#endif
+            bytes_read = read(conn->client_fd,
+                              conn->buffer->request_buffer + conn->request_len,
+                              REQUEST_BUFFER_SIZE - 1 - conn->request_len);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            log_debug("read failed: %s", strerror(errno));
+            return RESULT_ERR;
+        } else if (bytes_read == 0) {
+            log_debug("Connection closed by client (fd %d)", conn->client_fd);
+            return total_read > 0 ? RESULT_OK : RESULT_ERR;
+        }
+        conn->request_len += bytes_read;
+        total_read += bytes_read;
+    }
+
+    if (total_read == 0) {
+        return RESULT_ERR_AGAIN;
+    }
+    if (request_started) {
+        start_request(conn);
+    }
+    return RESULT_OK;
+}
+
+void prepare_response(struct connection* conn) {
+    enum result parse_res = parse_request(conn);
+    if (parse_res != RESULT_OK) {
+        prepare_error_response(conn);
+
+    } else if (conn->admission != NULL && config.ip_rate > 0 && !admission_allow_request(conn->admission)) {
+        conn->status_code = STATUS_SERVICE_UNAVAILABLE;
+        prepare_error_response(conn);
+
+    } else if (conn->method == METHOD_GET) {
+        prepare_cached_response(conn);
+
+    } else {
+        conn->status_code = STATUS_METHOD_NOT_ALLOWED;
+        prepare_error_response(conn);
+    }
+}
+
+void reset_request(struct connection* conn) {
+    access_log_request(conn);
+    metrics_request(conn);
+
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    if (conn->cache != NULL) {
+        cache_unpin(conn->cache);
+        conn->cache = NULL;
+        conn->cached_response = NULL;
+    }
+
+    conn->request_len -= conn->request_end;
+    memmove(conn->buffer->request_buffer, conn->buffer->request_buffer + conn->request_end, conn->request_len);
+    conn->request_end = 0;
+    http_request_reset(&conn->buffer->request);
+    conn->requests_served++;
+    if (conn->request_len > 0) {
+        start_request(conn);
+    } else {
+        connection_set_timeout(conn, config.keepalive_timeout);
+    }
+
+    conn->response_header_len = 0;
+    conn->status_code = STATUS_OK;
+    conn->file_offset = 0;
+    conn->file_end = 0;
+    conn->bytes_sent = 0;
+}
+
+int request_overflow_status(const struct http_request* req) {
+    switch (req->state) {
+        case PARSE_TARGET:
+            return STATUS_URI_TOO_LONG;
+        case PARSE_LINE_END:
+        case PARSE_HEADER_NAME:
+        case PARSE_HEADER_VALUE:
+        case PARSE_HEADERS_END:
+            return STATUS_HEADER_FIELDS_TOO_LARGE;
+        default:
+            return STATUS_BAD_REQUEST;
+    }
+}
+
+enum result prepare_next_response(struct connection* conn) {
+    enum result parse_res = parse_http_request(&conn->buffer->request, conn->buffer->request_buffer, conn->request_len);
+
+    if (parse_res == RESULT_OK) {
+        conn->request_end = conn->buffer->request.offset;
+        prepare_response(conn);
+    } else if (parse_res == RESULT_ERR) {
+        log_debug("Malformed request for fd %d, closing connection", conn->client_fd);
+        conn->request_end = conn->request_len;
+        conn->status_code = conn->buffer->request.state == PARSE_TOO_MANY_HEADERS ? STATUS_HEADER_FIELDS_TOO_LARGE : STATUS_BAD_REQUEST;
+        prepare_error_response(conn);
+    } else if (conn->buffer->request.state == PARSE_BODY &&
+               conn->buffer->request.token_start + (size_t)conn->buffer->request.content_length >= REQUEST_BUFFER_SIZE) {
+        log_debug("Request body too large for fd %d, closing connection", conn->client_fd);
+        conn->request_end = conn->request_len;
+        conn->status_code = STATUS_CONTENT_TOO_LARGE;
+        prepare_error_response(conn);
+    } else if (conn->request_len >= REQUEST_BUFFER_SIZE - 1) {
+        log_debug("Request buffer full for fd %d, closing connection", conn->client_fd);
+        conn->request_end = conn->request_len;
+        conn->status_code = request_overflow_status(&conn->buffer->request);
+        prepare_error_response(conn);
+    } else {
+        return RESULT_ERR_AGAIN;
+    }
+    return RESULT_OK;
+}
+
+enum result handle_client_request(struct connection* conn) {
+    if (conn->buffer == NULL) {
+        if (borrow_connection_buffer(conn) != RESULT_OK) {
+            return RESULT_ERR;
+        }
+        http_request_reset(&conn->buffer->request);
+    }
+
+    while (1) {
+        if (prepare_next_response(conn) != RESULT_OK) {
+            enum result read_res = read_request_data(conn);
+            if (read_res == RESULT_ERR_AGAIN) {
+                if (conn->request_len == 0) {
+                    return_connection_buffer(conn);
+                }
+                if (set_connection_state(conn, CONNECTION_READING) != RESULT_OK) {
+                    return RESULT_ERR;
+                }
+                return RESULT_ERR_AGAIN;
+            }
+            if (read_res != RESULT_OK) {
+                return RESULT_ERR;
+            }
+            continue;
+        }
+
+        enum result send_res = send_response(conn);
+        if (send_res == RESULT_ERR_AGAIN) {
+            if (set_connection_state(conn, CONNECTION_WRITING) != RESULT_OK) {
+                return RESULT_ERR;
+            }
+            return RESULT_ERR_AGAIN;
+        }
+        if (send_res != RESULT_OK || !conn->keep_alive) {
+            return send_res;
+        }
+        reset_request(conn);
+    }
+}
+
+enum result handle_client_write(struct connection* conn) {
+    long bytes_sent = conn->bytes_sent;
+    enum result send_res = send_response(conn);
+    if (send_res == RESULT_ERR_AGAIN && conn->bytes_sent != bytes_sent) {
+        connection_set_timeout(conn, config.send_timeout);
+    }
+    if (send_res != RESULT_OK || !conn->keep_alive) {
+        return send_res;
+    }
+    reset_request(conn);
+    return handle_client_request(conn);
+}
+
+uint64_t monotonic_ticks() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+void timer_expire(struct connection* conn) {
+    if (conn->state == CONNECTION_WRITING) {
+        log_debug("Send timed out for fd %d", conn->client_fd);
+    } else if (conn->request_len > 0) {
+        log_debug("Request timed out for fd %d", conn->client_fd);
+    } else {
+        log_debug("Closing idle connection for fd %d", conn->client_fd);
+    }
+    close_connection(conn);
+}
+
+void timer_cascade(int level) {
+    struct connection** slot = &timer_wheel[level][(timer_tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SIZE - 1)];
+    struct connection* conn = *slot;
+    *slot = NULL;
+    while (conn != NULL) {
+        struct connection* next = conn->timer_next;
+        timer_insert(conn);
+        conn = next;
+    }
+}
+
+void timer_advance(uint64_t now) {
+    if (timer_count == 0) {
+        timer_tick = now;
+    }
+    while (timer_tick < now) {
+        ++timer_tick;
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+            if ((timer_tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) == 0) {
+                timer_cascade(level);
+            }
+        }
+
+        struct connection** slot = &timer_wheel[0][timer_tick & (TIMER_WHEEL_SIZE - 1)];
+        while (*slot != NULL) {
+            struct connection* conn = *slot;
+            timer_remove(conn);
+            timer_expire(conn);
+        }
+    }
+}
+
+void pause_accepting(struct worker* worker) {
+    worker->accept_paused = 1;
+    counter_add(&worker->metrics.accept_pauses, 1);
+    log_debug("Worker %d pool full, pausing accepts", worker->id);
+#ifdef WITH_IO_URING
+    if (uring.fd != -1) {
+        if (worker->accept_armed) {
+            uring_prep_cancel_accept(worker);
+        }
+        return;
+    }
+#endif
+    event_backend_remove(worker->listen_fd);
+}
+
+void resume_accepting(struct worker* worker) {
+    if (!worker->accept_paused || worker->listen_fd == -1 ||
+        connection_active_count + connection_limit / ACCEPT_RESUME_DIVISOR >= connection_limit) {
+        return;
+    }
+    worker->accept_paused = 0;
+    log_debug("Worker %d resuming accepts", worker->id);
+#ifdef WITH_IO_URING
+    if (uring.fd != -1) {
+        if (!worker->accept_armed) {
+            uring_prep_accept(worker);
+        }
+        return;
+    }
+#endif
+    event_backend_add(worker->listen_fd, EVENT_READ, worker, 0);
+}
+
+void accept_connections(struct worker* worker) {
+    for (int i = 0; i < ACCEPT_BATCH_SIZE; ++i) {
+        if (config.overload == OVERLOAD_PAUSE && connection_pool_full()) {
+            pause_accepting(worker);
+            return;
+        }
+        int client_fd = accept4(worker->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_errno("accept failed");
+            }
+            return;
+        }
+
+        struct admission_slot* admission;
+        if (admit_connection(client_fd, &admission) != RESULT_OK) {
+            log_debug("Per-address connection limit reached, rejecting fd %d", client_fd);
+            reject_connection(client_fd);
+            continue;
+        }
+        struct connection* conn = get_free_connection(client_fd);
+        if (conn == NULL) {
+            log_warn("Max connections reached, rejecting new connection");
+            admission_release(admission);
+            reject_connection(client_fd);
+            continue;
+        }
+        conn->admission = admission;
+#ifdef WITH_TLS
+        if (tls_ctx != NULL) {
+            conn->tls = SSL_new(tls_ctx);
+            if (conn->tls == NULL || !SSL_set_fd(conn->tls, client_fd)) {
+                log_error("Cannot set up TLS for fd %d", client_fd);
+                release_connection(conn);
+                continue;
+            }
+            SSL_set_accept_state(conn->tls);
+        }
+#endif
+        if (event_backend_add(client_fd, EVENT_READ, conn, 1) != RESULT_OK) {
+            release_connection(conn);
+            continue;
+        }
+        log_debug("New connection accepted, fd %d", client_fd);
+    }
+}
+
+void worker_stop_accepting(struct worker* worker) {
+#ifdef WITH_IO_URING
+    if (uring.fd != -1 && worker->accept_armed) {
+        uring_prep_cancel_accept(worker);
+    }
+#endif
+    if (event_fd != -1) {
+        if (!worker->accept_paused) {
+            event_backend_remove(worker->listen_fd);
+        }
+        event_backend_remove(handoff_wake_fd);
+    }
+    close(worker->listen_fd);
+    worker->listen_fd = -1;
+    log_info("Worker %d stopped accepting, draining %d connections", worker->id, connection_active_count);
+}
+
+int connection_is_idle(const struct connection* conn) {
+#ifdef WITH_IO_URING
+    if (conn->uring_flags & (URING_CLOSING | URING_STARVED) || conn->uring_held_count > 0) {
+        return 0;
+    }
+#endif
+    return conn->state == CONNECTION_READING && conn->request_len == 0;
+}
+
+int worker_drain() {
+    int expired = loop_tick >= atomic_load(&drain_deadline);
+    for (int i = connection_active_count - 1; i >= 0; --i) {
+        struct connection* conn = connection_slots[i].conn;
+        if (expired || connection_is_idle(conn)) {
+            close_connection(conn);
+        }
+    }
+    return connection_active_count == 0;
+}
+
+#ifdef WITH_IO_URING
+void uring_hold_buffer(struct connection* conn, uint16_t bid, int len) {
+    uring.buffer_len[bid] = len;
+    uring.buffer_next[bid] = URING_NO_BUFFER;
+    if (conn->uring_held_tail == URING_NO_BUFFER) {
+        conn->uring_held_head = bid;
+    } else {
+        uring.buffer_next[conn->uring_held_tail] = bid;
+    }
+    conn->uring_held_tail = bid;
+    ++conn->uring_held_count;
+}
+
+enum result uring_fill_request(struct connection* conn) {
+    while (conn->uring_held_head != URING_NO_BUFFER && conn->request_len < REQUEST_BUFFER_SIZE - 1) {
+        if (conn->buffer == NULL) {
+            if (borrow_connection_buffer(conn) != RESULT_OK) {
+                return RESULT_ERR;
+            }
+            http_request_reset(&conn->buffer->request);
+        }
+        if (conn->request_len == 0) {
+            start_request(conn);
+        }
+
+        uint16_t bid = conn->uring_held_head;
+        size_t available = uring.buffer_len[bid] - conn->uring_held_offset;
+        size_t space = REQUEST_BUFFER_SIZE - 1 - conn->request_len;
+        size_t len = available < space ? available : space;
+        memcpy(conn->buffer->request_buffer + conn->request_len,
+               uring.buffers + (size_t)bid * URING_BUFFER_SIZE + conn->uring_held_offset, len);
+        conn->request_len += len;
+        conn->uring_held_offset += len;
+
+        if (conn->uring_held_offset == uring.buffer_len[bid]) {
+            conn->uring_held_head = uring.buffer_next[bid];
+            conn->uring_held_offset = 0;
+            --conn->uring_held_count;
+            if (conn->uring_held_head == URING_NO_BUFFER) {
+                conn->uring_held_tail = URING_NO_BUFFER;
+            }
+            uring_recycle_buffer(bid);
+        }
+    }
+    return RESULT_OK;
+}
+
+enum result uring_send_cached(struct connection* conn) {
+    struct iovec iov[3];
+    int iov_count = cached_response_iovec(conn, iov);
+    struct connection_buffer* buffer = conn->buffer;
+
+    iov_count = skip_iovec(iov, iov_count, conn->bytes_sent, buffer->message_iov);
+    if (iov_count == 0) {
+        return RESULT_OK;
+    }
+    memset(&buffer->message, 0, sizeof(buffer->message));
+    buffer->message.msg_iov = buffer->message_iov;
+    buffer->message.msg_iovlen = iov_count;
+
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->client_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&buffer->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (conn->keep_alive && next_request_buffered(conn) ? MSG_MORE : 0);
+    sqe->user_data = uring_user_data(conn, URING_OP_SEND);
+    ++conn->uring_pending;
+    return RESULT_ERR_AGAIN;
+}
+
+enum result uring_send_response(struct connection* conn) {
+    enum result send_res;
+    if (conn->cached_response != NULL) {
+        send_res = uring_send_cached(conn);
+    } else {
+        send_res = send_response(conn);
+        if (send_res == RESULT_ERR_AGAIN) {
+            uring_prep_poll_out(conn);
+        }
+    }
+    if (send_res == RESULT_ERR_AGAIN) {
+        conn->state = CONNECTION_WRITING;
+        connection_set_timeout(conn, config.send_timeout);
+    }
+    return send_res;
+}
+
+void uring_process(struct connection* conn) {
+    while (conn->state == CONNECTION_READING) {
+        if (uring_fill_request(conn) != RESULT_OK) {
+            uring_close_connection(conn);
+            return;
+        }
+        if (conn->buffer == NULL || prepare_next_response(conn) != RESULT_OK) {
+            if (conn->buffer != NULL && conn->request_len == 0) {
+                return_connection_buffer(conn);
+            }
+            if (conn->uring_flags & URING_PEER_CLOSED) {
+                uring_close_connection(conn);
+                return;
+            }
+            break;
+        }
+
+        enum result send_res = uring_send_response(conn);
+        if (send_res == RESULT_ERR_AGAIN) {
+            break;
+        }
+        if (send_res != RESULT_OK || !conn->keep_alive) {
+            uring_close_connection(conn);
+            return;
+        }
+        reset_request(conn);
+    }
+
+    if (conn->uring_flags & (URING_CLOSING | URING_PEER_CLOSED | URING_STARVED)) {
+        return;
+    }
+    if (!(conn->uring_flags & URING_RECV_ARMED)) {
+        if (conn->uring_held_count == 0) {
+            uring_prep_recv(conn);
+        }
+    } else if (conn->uring_held_count > URING_MAX_HELD_BUFFERS && !(conn->uring_flags & URING_RECV_CANCELING)) {
+        uring_prep_cancel_recv(conn);
+    }
+}
+
+void uring_accept_client(int res) {
+    if (res < 0) {
+        if (res != -EAGAIN && res != -ECONNABORTED && res != -EINTR && res != -ECANCELED) {
+            log_error("accept failed: %s", strerror(-res));
+        }
+        return;
+    }
+
+    struct admission_slot* admission;
+    if (admit_connection(res, &admission) != RESULT_OK) {
+        log_debug("Per-address connection limit reached, rejecting fd %d", res);
+        reject_connection(res);
+        return;
+    }
+    struct connection* conn = get_free_connection(res);
+    if (conn == NULL) {
+        log_warn("Max connections reached, rejecting new connection");
+        admission_release(admission);
+        reject_connection(res);
+        return;
+    }
+    conn->admission = admission;
+    log_debug("New connection accepted, fd %d", conn->client_fd);
+    uring_prep_recv(conn);
+}
+
+void uring_handle_accept(struct worker* worker, const struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        worker->accept_armed = 0;
+    }
+    uring_accept_client(cqe->res);
+
+    if (config.overload == OVERLOAD_PAUSE && !worker->accept_paused) {
+        if (connection_pool_full()) {
+            pause_accepting(worker);
+        } else if (worker->accept_armed && worker->accept_multishot && connection_limit - connection_active_count <= ACCEPT_BATCH_SIZE) {
+            uring_prep_cancel_accept(worker);
+            worker->accept_multishot = 0;
+        }
+    }
+    if (!worker->accept_armed && !worker->accept_paused && worker->listen_fd != -1) {
+        uring_prep_accept(worker);
+    }
+}
+
+void uring_handle_recv(struct connection* conn, const struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->uring_flags &= ~URING_RECV_ARMED;
+        --conn->uring_pending;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !(conn->uring_flags & URING_CLOSING)) {
+            uring_hold_buffer(conn, bid, cqe->res);
+        } else {
+            uring_recycle_buffer(bid);
+        }
+    }
+
+    if (conn->uring_flags & URING_CLOSING) {
+        uring_close_connection(conn);
+        return;
+    }
+    if (cqe->res == -ENOBUFS) {
+        conn->uring_flags |= URING_STARVED;
+        conn->uring_starved_next = uring.starved;
+        uring.starved = conn;
+    } else if (cqe->res == 0) {
+        log_debug("Connection closed by client (fd %d)", conn->client_fd);
+        conn->uring_flags |= URING_PEER_CLOSED;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        log_debug("recv failed: %s", strerror(-cqe->res));
+        uring_close_connection(conn);
+        return;
+    }
+    uring_process(conn);
+}
+
+void uring_handle_send(struct connection* conn, enum uring_op op, int res) {
+    --conn->uring_pending;
+    if (conn->uring_flags & URING_CLOSING) {
+        uring_close_connection(conn);
+        return;
+    }
+
+    long bytes_sent = conn->bytes_sent;
+    enum result send_res;
+    if (op == URING_OP_SEND) {
+        if (res < 0) {
+            log_debug("sendmsg failed: %s", strerror(-res));
+            uring_close_connection(conn);
+            return;
+        }
+        conn->bytes_sent += res;
+        send_res = uring_send_cached(conn);
+        if (send_res == RESULT_ERR_AGAIN) {
+            counter_add(&current_worker->metrics.send_again, 1);
+        }
+    } else {
+        send_res = send_response(conn);
+        if (send_res == RESULT_ERR_AGAIN) {
+            uring_prep_poll_out(conn);
+        }
+    }
+    if (send_res == RESULT_ERR_AGAIN) {
+        if (conn->bytes_sent != bytes_sent) {
+            connection_set_timeout(conn, config.send_timeout);
+        }
+        return;
+    }
+    if (send_res != RESULT_OK || !conn->keep_alive) {
+        uring_close_connection(conn);
+        return;
+    }
+
+    conn->state = CONNECTION_READING;
+    reset_request(conn);
+    uring_process(conn);
+}
+
+void uring_handle_cancel(struct connection* conn) {
+    --conn->uring_pending;
+    conn->uring_flags &= ~URING_RECV_CANCELING;
+    if (conn->uring_flags & URING_CLOSING) {
+        uring_close_connection(conn);
+    }
+}
+
+void uring_reap() {
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe* cqe = &uring.cqes[head & uring.cq_mask];
+        void* target = (void*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+        enum uring_op op = cqe->user_data & URING_OP_MASK;
+
+        switch (op) {
+            case URING_OP_ACCEPT:
+                uring_handle_accept(target, cqe);
+                break;
+            case URING_OP_RECV:
+                uring_handle_recv(target, cqe);
+                break;
+            case URING_OP_SEND:
+            case URING_OP_POLL:
+                uring_handle_send(target, op, cqe->res);
+                break;
+            case URING_OP_CANCEL:
+                uring_handle_cancel(target);
+                break;
+            case URING_OP_WAKE:
+                if (((struct worker*)target)->listen_fd != -1) {
+                    worker_stop_accepting(target);
+                }
+                break;
+            case URING_OP_CANCEL_ACCEPT:
+                break;
+        }
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_wake_starved() {
+    if (!uring.buffers_recycled) {
+        return;
+    }
+    uring.buffers_recycled = 0;
+
+    struct connection* conn = uring.starved;
+    uring.starved = NULL;
+    while (conn != NULL) {
+        struct connection* next = conn->uring_starved_next;
+        conn->uring_flags &= ~URING_STARVED;
+        uring_process(conn);
+        conn = next;
+    }
+}
+
+void uring_worker_loop(struct worker* worker) {
+    uring_prep_accept(worker);
+    if (handoff_wake_fd != -1) {
+        uring_prep_wake(worker);
+    }
+    log_debug("Worker %d starting io_uring loop", worker->id);
+
+    while (1) {
+        cache_worker_offline(worker);
+        int res = uring_enter(1, worker->listen_fd == -1 ? TIMER_TICK_MS : timer_wait_timeout());
+        cache_worker_online(worker);
+        loop_tick = monotonic_ticks();
+
+        if (res < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+            log_errno("io_uring_enter failed");
+            break;
+        }
+
+        uring_reap();
+        uring_wake_starved();
+        timer_advance(loop_tick);
+        resume_accepting(worker);
+        if (worker->listen_fd == -1 && worker_drain()) {
+            break;
+        }
+    }
+
+    uring_cleanup();
+    log_info("Worker %d shut down", worker->id);
+}
+#endif
+
+void worker_bind_cpu(struct worker* worker) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        log_warn("Cannot pin worker %d to CPU %d", worker->id, worker->cpu);
+        return;
+    }
+
+    unsigned int cpu;
+    unsigned int node;
+    unsigned long nodes;
+    if (getcpu(&cpu, &node) != 0 || node >= sizeof(nodes) * 8) {
+        return;
+    }
+    nodes = 1UL << node;
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodes, sizeof(nodes) * 8 + 1) != 0) {
+        log_debug("set_mempolicy failed: %s", strerror(errno));
+    }
+    log_debug("Worker %d pinned to CPU %u on node %u", worker->id, cpu, node);
 }
 
-enum result handle_client_request(struct connection* conn) {
-    ssize_t bytes_read;
+void* worker_main(void* arg) {
+    struct worker* worker = arg;
+    struct event events[MAX_EVENTS];
+
+    if (config.cpu_affinity) {
+        worker_bind_cpu(worker);
+    }
+    initialize_connection_pool();
+    current_worker = worker;
+    loop_tick = monotonic_ticks();
+    timer_tick = loop_tick;
+
+#ifdef WITH_IO_URING
+    if (config.io_uring) {
+        if (uring_init() == RESULT_OK) {
+            uring_worker_loop(worker);
+            return NULL;
+        }
+        log_warn("Worker %d falling back to epoll", worker->id);
+    }
+#endif
+
+    if (event_backend_init() != RESULT_OK) {
+        return NULL;
+    }
+
+    if (event_backend_add(worker->listen_fd, EVENT_READ, worker, 0) != RESULT_OK ||
+        (handoff_wake_fd != -1 && event_backend_add(handoff_wake_fd, EVENT_READ, &handoff_wake_fd, 0) != RESULT_OK)) {
+        close(event_fd);
+        return NULL;
+    }
+
+    log_debug("Worker %d starting main loop", worker->id);
+
+    while (1) {
+        cache_worker_offline(worker);
+        int activity = event_backend_wait(events, MAX_EVENTS, worker->listen_fd == -1 ? TIMER_TICK_MS : timer_wait_timeout());
+        cache_worker_online(worker);
+        loop_tick = monotonic_ticks();
+
+        if (activity < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_errno("event wait error");
+
+            break;
+        }
+
+        for (int i = 0; i < activity; ++i) {
+            if (events[i].data == &handoff_wake_fd) {
+                worker_stop_accepting(worker);
+                continue;
+            }
+            if (events[i].data == worker) {
+                if (worker->listen_fd != -1 && !worker->accept_paused) {
+                    accept_connections(worker);
+                }
+                continue;
+            }
+
+            struct connection* current_conn = events[i].data;
+            int should_close = 0;
 
-    if (conn->request_len < REQUEST_BUFFER_SIZE - 1) {
-        bytes_read = read(conn->client_fd,
-                          conn->request_buffer + conn->request_len,
-                          REQUEST_BUFFER_SIZE - 1 - conn->request_len);
+            if (current_conn->client_fd == -1) {
+                continue;
+            }
 
-        if (bytes_read < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                if (conn->request_len > 0) {
-                } else {
-                    return RESULT_ERR_AGAIN;
+            if (current_conn->state == CONNECTION_READING) {
+                if (events[i].events & EVENT_READ) {
+                    log_debug("Handling read event for fd %d", current_conn->client_fd);
+                    enum result res = handle_client_request(current_conn);
+                    if (res == RESULT_ERR) {
+                        log_debug("Error handling request for fd %d, closing", current_conn->client_fd);
+                        should_close = 1;
+                    } else if (res == RESULT_OK) {
+                        log_debug("Response sent completely for fd %d", current_conn->client_fd);
+
+                        should_close = 1;
+                    }
+                }
+            } else if (events[i].events & EVENT_WRITE) {
+                log_debug("Handling write event for fd %d", current_conn->client_fd);
+                enum result res = handle_client_write(current_conn);
+                if (res == RESULT_ERR) {
+                    log_debug("Error sending response for fd %d, closing", current_conn->client_fd);
+                    should_close = 1;
+                } else if (res == RESULT_OK) {
+                    log_debug("Response sent completely for fd %d", current_conn->client_fd);
+
+                    should_close = 1;
                 }
-            } else {
-                perror("read failed");
-                return RESULT_ERR;
             }
-        } else if (bytes_read == 0) {
-            printf("Connection closed by client (fd %d)\n", conn->client_fd);
-            return RESULT_ERR;
-        } else {
-            conn->request_len += bytes_read;
-            conn->request_buffer[conn->request_len] = '\0';
 
-            if (strstr(conn->request_buffer, "\r\n\r\n") == NULL && conn->request_len < REQUEST_BUFFER_SIZE - 1) {
-                printf("Potentially incomplete request received (%zu bytes), proceeding anyway...\n", conn->request_len);
+            if (should_close) {
+                close_connection(current_conn);
             }
         }
-    } else {
-        fprintf(stderr, "Request buffer full for fd %d, closing connection.\n", conn->client_fd);
-        conn->status_code = STATUS_BAD_REQUEST;
-        prepare_error_response(conn);
 
+        timer_advance(loop_tick);
+        resume_accepting(worker);
+        if (worker->listen_fd == -1 && worker_drain()) {
+            break;
+        }
+    }
+
+    close(event_fd);
+    log_info("Worker %d shut down", worker->id);
+
+    return NULL;
+}
+
+enum result metrics_open() {
+    if (config.metrics_port == 0) {
+        return RESULT_OK;
+    }
+    if (handoff_metrics_fd != -1) {
+        metrics_fd = handoff_metrics_fd;
+        log_info("Metrics listening on 127.0.0.1:%d", config.metrics_port);
+        return RESULT_OK;
+    }
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0) {
+        log_errno("socket failed");
         return RESULT_ERR;
     }
+    int opt = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-    enum result parse_res = parse_request(conn);
-    if (parse_res != RESULT_OK) {
-        prepare_error_response(conn);
+    struct sockaddr_in metrics_addr;
+    memset(&metrics_addr, 0, sizeof(metrics_addr));
+    metrics_addr.sin_family = AF_INET;
+    metrics_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    metrics_addr.sin_port = htons(config.metrics_port);
+    if (bind(metrics_fd, (struct sockaddr*)&metrics_addr, sizeof(metrics_addr)) < 0 || listen(metrics_fd, 16) < 0) {
+        log_errno("metrics listener failed");
+        close(metrics_fd);
+        metrics_fd = -1;
+        return RESULT_ERR;
+    }
+    log_info("Metrics listening on 127.0.0.1:%d", config.metrics_port);
+    return RESULT_OK;
+}
 
-    } else {
-        if (conn->method == METHOD_GET) {
-            enum result path_res = build_file_path(conn);
-            if (path_res != RESULT_OK) {
-                prepare_error_response(conn);
+unsigned long metrics_load(const struct worker* worker, size_t offset) {
+    return atomic_load_explicit((const _Atomic unsigned long*)((const char*)&worker->metrics + offset), memory_order_relaxed);
+}
 
-            } else {
-                enum result prep_res = prepare_success_response(conn);
-                if (prep_res != RESULT_OK) {
-                }
+void metrics_format_counter(FILE* out, const char* name, const char* help, size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < config.worker_count; ++i) {
+        fprintf(out, "%s{worker=\"%d\"} %lu\n", name, i, metrics_load(&workers[i], offset));
+    }
+}
+
+void metrics_format_histogram(FILE* out, const char* name, const char* help, size_t offset) {
+    unsigned long count = 0;
+    unsigned long sum_us = 0;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+        for (int i = 0; i < config.worker_count; ++i) {
+            count += metrics_load(&workers[i], offset + offsetof(struct latency_histogram, buckets) + bucket * sizeof(unsigned long));
+        }
+        if (bucket < HISTOGRAM_BUCKET_COUNT - 1) {
+            fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, (histogram_bucket_limit(bucket) + 1) / 1e6, count);
+        }
+    }
+    for (int i = 0; i < config.worker_count; ++i) {
+        sum_us += metrics_load(&workers[i], offset + offsetof(struct latency_histogram, sum_us));
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %g\n%s_count %lu\n", name, count, name, sum_us / 1e6, name, count);
+}
+
+void metrics_format(FILE* out) {
+    metrics_format_counter(out, "lkjsxccom_connections_accepted_total", "Connections accepted.",
+                           offsetof(struct worker_metrics, accepts));
+    metrics_format_counter(out, "lkjsxccom_connections_rejected_total", "Connections turned away by the pool or per-address limits.",
+                           offsetof(struct worker_metrics, rejects));
+    metrics_format_counter(out, "lkjsxccom_accept_pauses_total", "Times a worker stopped accepting because its pool was full.",
+                           offsetof(struct worker_metrics, accept_pauses));
+
+    fprintf(out, "# HELP lkjsxccom_responses_total Responses by status code.\n# TYPE lkjsxccom_responses_total counter\n");
+    for (int i = 0; i < config.worker_count; ++i) {
+        for (int status = 0; status < METRICS_STATUS_COUNT; ++status) {
+            char code[16] = "other";
+            if (status < METRICS_STATUS_COUNT - 1) {
+                snprintf(code, sizeof(code), "%d", metrics_statuses[status]);
             }
-        } else {
-            conn->status_code = STATUS_METHOD_NOT_ALLOWED;
-            prepare_error_response(conn);
+            fprintf(out, "lkjsxccom_responses_total{worker=\"%d\",code=\"%s\"} %lu\n", i, code,
+                    metrics_load(&workers[i], offsetof(struct worker_metrics, responses) + status * sizeof(unsigned long)));
         }
     }
 
-    if (conn->status_code == STATUS_OK || conn->file_to_send != NULL) {
-        printf("Request handled for fd %d, proceeding to send response.\n", conn->client_fd);
+    metrics_format_counter(out, "lkjsxccom_response_bytes_total", "Response bytes written, headers included.",
+                           offsetof(struct worker_metrics, bytes_sent));
+    metrics_format_counter(out, "lkjsxccom_cache_hits_total", "Requests answered from the in-memory route cache.",
+                           offsetof(struct worker_metrics, cache_hits));
+    metrics_format_counter(out, "lkjsxccom_cache_misses_total", "Requests for unknown routes or pages served from disk.",
+                           offsetof(struct worker_metrics, cache_misses));
+    metrics_format_counter(out, "lkjsxccom_send_again_total", "Response writes that hit a full socket buffer.",
+                           offsetof(struct worker_metrics, send_again));
+    metrics_format_counter(out, "lkjsxccom_traversal_rejected_total", "Requests refused for a .. path segment.",
+                           offsetof(struct worker_metrics, traversal_rejects));
+    metrics_format_histogram(out, "lkjsxccom_first_byte_seconds", "Time from accept to the first request byte.",
+                             offsetof(struct worker_metrics, first_byte_latency));
+    metrics_format_histogram(out, "lkjsxccom_response_seconds", "Time from the first request byte to the last response byte.",
+                             offsetof(struct worker_metrics, response_latency));
+}
 
-        enum result send_res = send_response(conn);
-        return send_res;
+void metrics_serve(int client_fd) {
+    char request[METRICS_REQUEST_MAX_LEN];
+    struct timeval timeout = {1, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-    } else {
-        enum result send_res = send_response(conn);
+    ssize_t len = read(client_fd, request, sizeof(request) - 1);
+    if (len <= 0) {
+        return;
+    }
+    request[len] = '\0';
 
-        if (send_res == RESULT_OK) {
-            printf("Error response sent successfully for fd %d, closing.\n", conn->client_fd);
-            return RESULT_ERR;
-        }
-        return send_res;
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if (out == NULL) {
+        return;
     }
+    int status_code = strncmp(request, "GET /metrics ", 13) == 0 ? STATUS_OK : STATUS_NOT_FOUND;
+    if (status_code == STATUS_OK) {
+        metrics_format(out);
+    }
+    fclose(out);
+
+    char header[RESPONSE_BUFFER_SIZE];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %d %s\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              status_code, get_status_message(status_code), body_len);
+    struct iovec iov[2] = {{header, header_len}, {body, body_len}};
+    long bytes_sent = 0;
+    write_iovec(client_fd, iov, 2, &bytes_sent);
+    free(body);
 }
 
-int main() {
-    int listen_fd;
-    int max_fd;
-    fd_set readfds;
-    fd_set writefds;
+void* metrics_main(void* arg) {
+    (void)arg;
+    struct pollfd pfds[2] = {{metrics_fd, POLLIN, 0}, {handoff_wake_fd, POLLIN, 0}};
 
-    initialize_connection_pool();
+    while (!(pfds[1].revents & POLLIN)) {
+        if (poll(pfds, 2, -1) <= 0 || !(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+        int client_fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                log_errno("metrics accept failed");
+            }
+            continue;
+        }
+        metrics_serve(client_fd);
+        close(client_fd);
+    }
 
-    if (setup_server_socket(&listen_fd) != RESULT_OK) {
-        return EXIT_FAILURE;
+    close(metrics_fd);
+    log_info("Metrics listener handed off");
+    return NULL;
+}
+
+#ifdef WITH_TLS
+int tls_select_alpn(SSL* ssl, const unsigned char** out, unsigned char* out_len, const unsigned char* in, unsigned int in_len, void* arg) {
+    static const unsigned char protocols[] = "\x08http/1.1";
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char**)out, out_len, protocols, sizeof(protocols) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
     }
+    return SSL_TLSEXT_ERR_OK;
+}
 
-    printf("Server starting main loop...\n");
+enum result tls_open() {
+    if (config.tls_cert_path == NULL) {
+        return RESULT_OK;
+    }
+    const char* key_path = config.tls_key_path != NULL ? config.tls_key_path : config.tls_cert_path;
 
-    while (1) {
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL) {
+        log_error("Cannot create TLS context");
+        return RESULT_ERR;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char*)"lkjsxccom", 9);
+    SSL_CTX_set_alpn_select_cb(tls_ctx, tls_select_alpn, NULL);
 
-        FD_SET(listen_fd, &readfds);
-        max_fd = listen_fd;
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, config.tls_cert_path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        log_error("Cannot load TLS certificate %s and key %s: %s", config.tls_cert_path, key_path,
+                  ERR_reason_error_string(ERR_get_error()));
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return RESULT_ERR;
+    }
+#ifdef WITH_IO_URING
+    if (config.io_uring) {
+        log_warn("TLS runs on the epoll backend, ignoring --io-uring");
+        config.io_uring = 0;
+    }
+#endif
+    if (config.overload == OVERLOAD_REJECT) {
+        log_warn("A 503 needs a TLS handshake, pausing accepts on overload instead");
+        config.overload = OVERLOAD_PAUSE;
+    }
+    log_info("TLS enabled with %s", config.tls_cert_path);
+    return RESULT_OK;
+}
+#endif
 
-        struct connection* conn = connection_active;
-        while (conn != NULL) {
-            if (conn->client_fd != -1) {
-                FD_SET(conn->client_fd, &readfds);
+enum result handoff_receive(const struct sockaddr_un* addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_errno("socket failed");
+        return RESULT_ERR;
+    }
+    if (connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0) {
+        int connect_errno = errno;
+        close(fd);
+        if (connect_errno == ENOENT || connect_errno == ECONNREFUSED) {
+            return RESULT_OK;
+        }
+        log_error("Cannot reach the running server at %s: %s", addr->sun_path, strerror(connect_errno));
+        return RESULT_ERR;
+    }
+    struct timeval timeout = {HANDOFF_RECEIVE_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-                if (conn->headers_sent || conn->response_header_buffer[0] != '\0') {
-                    FD_SET(conn->client_fd, &writefds);
-                }
+    struct handoff_message message;
+    char control[CMSG_SPACE(sizeof(int) * (MAX_WORKERS + 1))];
+    struct iovec iov = {&message, sizeof(message)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t len = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    close(fd);
 
-                if (conn->client_fd > max_fd) {
-                    max_fd = conn->client_fd;
-                }
-            }
-            conn = conn->next;
+    struct cmsghdr* cmsg = len < 0 ? NULL : CMSG_FIRSTHDR(&msg);
+    int fds[MAX_WORKERS + 1];
+    int fd_count = 0;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+    }
+    if (len != sizeof(message) || (msg.msg_flags & MSG_CTRUNC) || message.listener_count < 1 ||
+        message.listener_count > MAX_WORKERS || fd_count != message.listener_count + (message.metrics != 0)) {
+        log_error("Listener handoff from %s failed", addr->sun_path);
+        for (int i = 0; i < fd_count; ++i) {
+            close(fds[i]);
         }
+        return RESULT_ERR;
+    }
+
+    handoff_listener_count = message.listener_count;
+    memcpy(handoff_listeners, fds, handoff_listener_count * sizeof(int));
+    if (message.metrics && config.metrics_port != 0) {
+        handoff_metrics_fd = fds[handoff_listener_count];
+    } else if (message.metrics) {
+        close(fds[handoff_listener_count]);
+    }
+    if (handoff_listener_count > config.worker_count) {
+        log_warn("Took over %d listeners, running %d workers instead of %d", handoff_listener_count, handoff_listener_count, config.worker_count);
+        config.worker_count = handoff_listener_count;
+    }
+    log_info("Took over %d listeners from the running server", handoff_listener_count);
+    return RESULT_OK;
+}
 
-        int activity = select(max_fd + 1, &readfds, &writefds, NULL, NULL);
+enum result handoff_open(char** argv) {
+    if (config.handoff_path == NULL) {
+        return RESULT_OK;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(config.handoff_path) >= sizeof(addr.sun_path)) {
+        log_error("Handoff socket path %s is too long", config.handoff_path);
+        return RESULT_ERR;
+    }
+    strcpy(addr.sun_path, config.handoff_path);
 
-        if (activity < 0) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    handoff_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    handoff_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (handoff_signal_fd < 0 || handoff_wake_fd < 0) {
+        log_errno("handoff setup failed");
+        return RESULT_ERR;
+    }
+    signal(SIGCHLD, SIG_IGN);
+    handoff_argv = argv;
+
+    if (handoff_receive(&addr) != RESULT_OK) {
+        return RESULT_ERR;
+    }
+
+    handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_fd < 0) {
+        log_errno("socket failed");
+        return RESULT_ERR;
+    }
+    unlink(addr.sun_path);
+    if (bind(handoff_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(handoff_fd, 1) < 0) {
+        log_errno("handoff listener failed");
+        close(handoff_fd);
+        handoff_fd = -1;
+        return RESULT_ERR;
+    }
+    return RESULT_OK;
+}
+
+enum result handoff_send(int client_fd) {
+    struct ucred peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) < 0 || peer.uid != geteuid()) {
+        log_warn("Refusing listener handoff to a process of another user");
+        return RESULT_ERR;
+    }
+
+    struct handoff_message message = {config.worker_count, metrics_fd != -1};
+    int fds[MAX_WORKERS + 1];
+    int fd_count = 0;
+    for (int i = 0; i < config.worker_count; ++i) {
+        fds[fd_count++] = workers[i].listen_fd;
+    }
+    if (metrics_fd != -1) {
+        fds[fd_count++] = metrics_fd;
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&message, sizeof(message)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(fd_count * sizeof(int))};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+    if (sendmsg(client_fd, &msg, MSG_NOSIGNAL) != sizeof(message)) {
+        log_errno("Listener handoff failed");
+        return RESULT_ERR;
+    }
+    return RESULT_OK;
+}
+
+void handoff_spawn() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        pthread_sigmask(SIG_SETMASK, &signals, NULL);
+        execvp(handoff_argv[0], handoff_argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        log_errno("fork failed");
+        return;
+    }
+    log_info("Started %s as pid %d to take over the listeners", handoff_argv[0], (int)pid);
+}
+
+void* handoff_main(void* arg) {
+    (void)arg;
+    struct pollfd pfds[2] = {{handoff_signal_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}};
+
+    while (1) {
+        if (poll(pfds, 2, -1) < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            perror("select error");
-
-            break;
+            log_errno("poll failed");
+            return NULL;
+        }
+        struct signalfd_siginfo info;
+        if ((pfds[0].revents & POLLIN) && read(handoff_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            handoff_spawn();
+        }
+        if (pfds[1].revents & POLLIN) {
+            int client_fd = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                continue;
+            }
+            enum result res = handoff_send(client_fd);
+            close(client_fd);
+            if (res == RESULT_OK) {
+                break;
+            }
         }
+    }
 
-        if (FD_ISSET(listen_fd, &readfds)) {
-            struct sockaddr_in client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            int new_socket = accept(listen_fd, (struct sockaddr*)&client_addr, &addr_len);
+    close(handoff_fd);
+    log_info("Listeners handed off, draining connections for up to %d seconds", config.drain_timeout);
+    atomic_store(&drain_deadline, monotonic_ticks() + (uint64_t)config.drain_timeout * (1000 / TIMER_TICK_MS));
+    atomic_store(&server_draining, 1);
+    uint64_t wake = 1;
+    if (write(handoff_wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+        log_errno("Cannot wake workers to drain");
+    }
+    return NULL;
+}
 
-            if (new_socket < 0) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    perror("accept failed");
-                }
+void raise_file_limit() {
+    struct rlimit limit;
+    rlim_t wanted = (rlim_t)config.max_connections * 2 + config.worker_count * 2 + 64;
 
-            } else {
-                int flags = fcntl(new_socket, F_GETFL, 0);
-                if (flags == -1 || fcntl(new_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
-                    perror("fcntl O_NONBLOCK for new socket failed");
-                    close(new_socket);
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= wanted) {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur < wanted) {
+        log_warn("Open file limit %lu may be too low for %d connections", (unsigned long)limit.rlim_cur, config.max_connections);
+    }
+}
 
-                } else {
-                    struct connection* new_conn = get_free_connection();
-                    if (new_conn == NULL) {
-                        fprintf(stderr, "Max connections reached, rejecting new connection\n");
+void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -w, --workers N             number of worker threads (default: one per online CPU)\n"
+            "  -k, --keepalive-timeout S   close idle keep-alive connections after S seconds (default: %d)\n"
+            "  -r, --request-timeout S     close connections that take over S seconds to send a request (default: %d)\n"
+            "  -s, --send-timeout S        close connections whose response makes no progress for S seconds (default: %d)\n"
+            "  -m, --max-requests N        requests served per connection before closing (default: %d)\n"
+            "  -c, --max-connections N     open connections across all workers (default: %d)\n"
+            "  -b, --backlog N             listen queue length per worker (default: %d)\n"
+            "  -l, --log-level LEVEL       error, warn, info or debug (default: info, compiled up to %s)\n"
+            "  -a, --access-log PATH       access log file, - for stdout or off (default: -)\n"
+            "  -M, --metrics-port N        serve Prometheus metrics on 127.0.0.1:N (default: off)\n"
+            "  -B, --bundle PATH           serve routes from a packed bundle, remapped on SIGHUP\n"
+            "  -P, --pack-bundle PATH      pack ./routes into a bundle at PATH and exit\n"
+            "  -C, --cache-policy PATH     Cache-Control rules, one \"/route/ | *.ext | * value\" per line\n"
+            "  -A, --cpu-affinity          pin workers to CPUs, allocate on their NUMA node and steer connections to them\n"
+            "  -H, --handoff PATH          take over the listeners of the server at this Unix socket, hand them on after SIGUSR2\n"
+            "  -D, --drain-timeout S       seconds a server keeps serving open connections after handing off (default: %d)\n"
+            "  -O, --overload POLICY       when connections run out: pause accepting, 503 or close (default: pause)\n"
+            "  -I, --ip-connections N      open connections allowed per client address (default: unlimited)\n"
+            "  -R, --ip-rate N             requests per second allowed per client address, answered 503 beyond (default: unlimited)\n"
+#ifdef WITH_TLS
+            "  -T, --tls-cert PATH         serve HTTPS with this PEM certificate chain\n"
+            "  -K, --tls-key PATH          PEM private key (default: the certificate file)\n"
+#endif
+#ifdef WITH_IO_URING
+            "  -u, --io-uring              use io_uring instead of epoll for socket I/O\n"
+#endif
+            "  -h, --help                  show this help\n",
+            program, DEFAULT_KEEPALIVE_TIMEOUT, DEFAULT_REQUEST_TIMEOUT, DEFAULT_SEND_TIMEOUT, DEFAULT_MAX_REQUESTS, DEFAULT_MAX_CONNECTIONS, DEFAULT_LISTEN_BACKLOG, log_level_names[LOG_LEVEL_MAX], DEFAULT_DRAIN_TIMEOUT);
+}
 
-                        close(new_socket);
-                    } else {
-                        new_conn->client_fd = new_socket;
+enum result parse_arguments(int argc, char** argv) {
+    static const struct option options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"request-timeout", required_argument, NULL, 'r'},
+        {"send-timeout", required_argument, NULL, 's'},
+        {"max-requests", required_argument, NULL, 'm'},
+        {"max-connections", required_argument, NULL, 'c'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"access-log", required_argument, NULL, 'a'},
+        {"metrics-port", required_argument, NULL, 'M'},
+        {"bundle", required_argument, NULL, 'B'},
+        {"pack-bundle", required_argument, NULL, 'P'},
+        {"cache-policy", required_argument, NULL, 'C'},
+        {"cpu-affinity", no_argument, NULL, 'A'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"drain-timeout", required_argument, NULL, 'D'},
+        {"overload", required_argument, NULL, 'O'},
+        {"ip-connections", required_argument, NULL, 'I'},
+        {"ip-rate", required_argument, NULL, 'R'},
+#ifdef WITH_TLS
+        {"tls-cert", required_argument, NULL, 'T'},
+        {"tls-key", required_argument, NULL, 'K'},
+#endif
+#ifdef WITH_IO_URING
+        {"io-uring", no_argument, NULL, 'u'},
+#endif
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
 
-                        printf("New connection accepted, fd %d\n", new_socket);
+    static const char short_options[] = "w:k:r:s:m:c:b:l:a:M:B:P:C:AH:D:O:I:R:"
+#ifdef WITH_TLS
+                                        "T:K:"
+#endif
+#ifdef WITH_IO_URING
+                                        "u"
+#endif
+                                        "h";
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                config.worker_count = atoi(optarg);
+                if (config.worker_count < 1 || config.worker_count > MAX_WORKERS) {
+                    fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+                    return RESULT_ERR;
+                }
+                break;
+            case 'k':
+                config.keepalive_timeout = atoi(optarg);
+                if (config.keepalive_timeout < 1) {
+                    fprintf(stderr, "Keep-alive timeout must be at least 1 second\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'r':
+                config.request_timeout = atoi(optarg);
+                if (config.request_timeout < 1) {
+                    fprintf(stderr, "Request timeout must be at least 1 second\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 's':
+                config.send_timeout = atoi(optarg);
+                if (config.send_timeout < 1) {
+                    fprintf(stderr, "Send timeout must be at least 1 second\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'm':
+                config.max_requests = atoi(optarg);
+                if (config.max_requests < 1) {
+                    fprintf(stderr, "Max requests must be at least 1\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'c':
+                config.max_connections = atoi(optarg);
+                if (config.max_connections < 1) {
+                    fprintf(stderr, "Max connections must be at least 1\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                if (config.backlog < 1) {
+                    fprintf(stderr, "Backlog must be at least 1\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'l':
+                config.log_level = -1;
+                for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; ++i) {
+                    if (strcmp(optarg, log_level_names[i]) == 0) {
+                        config.log_level = i;
                     }
                 }
-            }
+                if (config.log_level < 0) {
+                    fprintf(stderr, "Log level must be error, warn, info or debug\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'a':
+                config.access_log_path = optarg;
+                break;
+            case 'B':
+                config.bundle_path = optarg;
+                break;
+            case 'P':
+                config.pack_bundle_path = optarg;
+                break;
+            case 'C':
+                config.cache_policy_path = optarg;
+                break;
+            case 'A':
+                config.cpu_affinity = 1;
+                break;
+            case 'H':
+                config.handoff_path = optarg;
+                break;
+            case 'D':
+                config.drain_timeout = atoi(optarg);
+                if (config.drain_timeout < 1) {
+                    fprintf(stderr, "Drain timeout must be at least 1 second\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'O':
+                if (strcmp(optarg, "pause") == 0) {
+                    config.overload = OVERLOAD_PAUSE;
+                } else if (strcmp(optarg, "503") == 0) {
+                    config.overload = OVERLOAD_REJECT;
+                } else if (strcmp(optarg, "close") == 0) {
+                    config.overload = OVERLOAD_CLOSE;
+                } else {
+                    fprintf(stderr, "Overload policy must be pause, 503 or close\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'I':
+                config.ip_connections = atoi(optarg);
+                if (config.ip_connections < 1) {
+                    fprintf(stderr, "Connections per address must be at least 1\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'R':
+                config.ip_rate = atoi(optarg);
+                if (config.ip_rate < 1) {
+                    fprintf(stderr, "Requests per second per address must be at least 1\n");
+                    return RESULT_ERR;
+                }
+                break;
+            case 'M':
+                config.metrics_port = atoi(optarg);
+                if (config.metrics_port < 1 || config.metrics_port > 65535) {
+                    fprintf(stderr, "Metrics port must be between 1 and 65535\n");
+                    return RESULT_ERR;
+                }
+                break;
+#ifdef WITH_TLS
+            case 'T':
+                config.tls_cert_path = optarg;
+                break;
+            case 'K':
+                config.tls_key_path = optarg;
+                break;
+#endif
+#ifdef WITH_IO_URING
+            case 'u':
+                config.io_uring = 1;
+                break;
+#endif
+            case 'h':
+            default:
+                print_usage(argv[0]);
+                return RESULT_ERR;
         }
+    }
 
-        struct connection* current_conn = connection_active;
-        struct connection* next_conn = NULL;
-        while (current_conn != NULL) {
-            next_conn = current_conn->next;
-            int should_close = 0;
+    if (config.worker_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.worker_count = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+    }
+    return RESULT_OK;
+}
 
-            if (current_conn->client_fd == -1) {
-                current_conn = next_conn;
-                continue;
-            }
+#ifndef LKJSXCCOM_NO_MAIN
+int main(int argc, char** argv) {
+    if (parse_arguments(argc, argv) != RESULT_OK) {
+        return EXIT_FAILURE;
+    }
+    if (config.cache_policy_path != NULL && cache_policy_load(config.cache_policy_path) != RESULT_OK) {
+        return EXIT_FAILURE;
+    }
+    if (config.pack_bundle_path != NULL) {
+        return bundle_pack(config.pack_bundle_path) == RESULT_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-            if (FD_ISSET(current_conn->client_fd, &readfds)) {
-                if (!current_conn->headers_sent && current_conn->file_to_send == NULL) {
-                    printf("Handling read event for fd %d\n", current_conn->client_fd);
-                    enum result res = handle_client_request(current_conn);
-                    if (res == RESULT_ERR) {
-                        printf("Error handling request for fd %d, closing.\n", current_conn->client_fd);
-                        should_close = 1;
-                    }
+    log_info("Request scanning uses %s", simd_init());
 
-                } else {
-                    printf("Ignoring read event for fd %d while sending response.\n", current_conn->client_fd);
-                }
-            }
+    signal(SIGPIPE, SIG_IGN);
+    raise_file_limit();
 
-            if (!should_close && FD_ISSET(current_conn->client_fd, &writefds)) {
-                if (current_conn->headers_sent || current_conn->response_header_buffer[0] != '\0') {
-                    printf("Handling write event for fd %d\n", current_conn->client_fd);
-                    enum result res = send_response(current_conn);
-                    if (res == RESULT_ERR) {
-                        printf("Error sending response for fd %d, closing.\n", current_conn->client_fd);
-                        should_close = 1;
-                    } else if (res == RESULT_OK) {
-                        printf("Response sent completely for fd %d.\n", current_conn->client_fd);
+    cache_watch_open();
+    struct response_cache* cache = cache_load(NULL);
+    if (cache == NULL) {
+        return EXIT_FAILURE;
+    }
+    cache_publish(cache);
 
-                        should_close = 1;
-                    }
-                }
-            }
+    if (handoff_open(argv) != RESULT_OK || access_log_open() != RESULT_OK || metrics_open() != RESULT_OK) {
+        return EXIT_FAILURE;
+    }
+#ifdef WITH_TLS
+    if (tls_open() != RESULT_OK) {
+        return EXIT_FAILURE;
+    }
+#endif
+    request_timing = access_log_fd != -1 || metrics_fd != -1;
 
-            if (should_close) {
-                close_connection(current_conn);
-            }
+    pthread_t cache_refresh_thread;
+    if (pthread_create(&cache_refresh_thread, NULL, cache_refresh_main, NULL) != 0) {
+        log_errno("pthread_create failed");
+        return EXIT_FAILURE;
+    }
+
+    if (config.cpu_affinity) {
+        assign_worker_cpus();
+    }
+    for (int i = 0; i < config.worker_count; ++i) {
+        workers[i].id = i;
+        if (i < handoff_listener_count) {
+            workers[i].listen_fd = handoff_listeners[i];
+            listen(workers[i].listen_fd, config.backlog);
+        } else if (setup_server_socket(&workers[i].listen_fd) != RESULT_OK) {
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.cpu_affinity) {
+        steer_listeners();
+    } else if (handoff_listener_count > 0) {
+        setsockopt(workers[0].listen_fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, NULL, 0);
+    }
+    log_info("Server listening on port %d with %d workers", PORT, config.worker_count);
+
+    pthread_t access_log_thread;
+    if (access_log_fd != -1 && pthread_create(&access_log_thread, NULL, access_log_main, NULL) != 0) {
+        log_errno("pthread_create failed");
+        return EXIT_FAILURE;
+    }
+
+    pthread_t metrics_thread;
+    if (metrics_fd != -1 && pthread_create(&metrics_thread, NULL, metrics_main, NULL) != 0) {
+        log_errno("pthread_create failed");
+        return EXIT_FAILURE;
+    }
 
-            current_conn = next_conn;
+    for (int i = 0; i < config.worker_count; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            log_errno("pthread_create failed");
+            return EXIT_FAILURE;
         }
     }
 
-    close(listen_fd);
-    printf("Server shut down.\n");
+    pthread_t handoff_thread;
+    if (handoff_fd != -1 && pthread_create(&handoff_thread, NULL, handoff_main, NULL) != 0) {
+        log_errno("pthread_create failed");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < config.worker_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].listen_fd != -1) {
+            close(workers[i].listen_fd);
+        }
+    }
+    if (access_log_fd != -1) {
+        access_log_flush();
+    }
+    log_info("Server shut down");
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif